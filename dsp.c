@@ -0,0 +1,482 @@
+
+#include "dsp.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define DSP_HAVE_NEON
+#endif
+
+#define DSP_CONF_LINE_MAX 256
+// default gain smoothing time constant
+#define DSP_GAIN_SMOOTH_MS 5.0
+
+static inline int32_t sat32(int64_t v)
+{
+  if (v > INT32_MAX)
+    return INT32_MAX;
+  if (v < INT32_MIN)
+    return INT32_MIN;
+  return (int32_t)v;
+}
+
+static inline uint64_t now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* @brief Convert a time constant to a Q1.31 per-frame decay factor */
+static int32_t time_to_coef(double ms, unsigned int sample_rate)
+{
+  double frames = ms * sample_rate / 1000.0;
+
+  if (frames < 1.0)
+    return 0;
+
+  return (int32_t)lrint(exp(-1.0 / frames) * INT32_MAX);
+}
+
+/* Gain */
+
+/* @brief Constant gain over a block, clamping first so no product overflows
+   @param buf samples
+   @param n number of samples (not frames)
+   @param gain Q8.24 gain
+   @param limit clamp for input samples */
+static void gain_block(int32_t* buf, unsigned int n, int32_t gain, int32_t limit)
+{
+  unsigned int i = 0;
+  int32_t x;
+
+#if defined(DSP_HAVE_NEON)
+  int32x4_t vmax = vdupq_n_s32(limit);
+  int32x4_t vmin = vdupq_n_s32(-limit);
+  int32x2_t vg = vdup_n_s32(gain);
+
+  for (; i + 4 <= n; i += 4)
+    {
+      int32x4_t v = vld1q_s32(buf + i);
+      int64x2_t lo, hi;
+
+      v = vminq_s32(vmaxq_s32(v, vmin), vmax);
+      lo = vmull_s32(vget_low_s32(v), vg);
+      hi = vmull_s32(vget_high_s32(v), vg);
+      vst1q_s32(buf + i, vcombine_s32(vshrn_n_s64(lo, DSP_GAIN_SHIFT),
+                                      vshrn_n_s64(hi, DSP_GAIN_SHIFT)));
+    }
+#endif
+
+  for (; i < n; i++)
+    {
+      x = buf[i];
+      if (x > limit)
+        x = limit;
+      else if (x < -limit)
+        x = -limit;
+      buf[i] = (int32_t)(((int64_t)x * gain) >> DSP_GAIN_SHIFT);
+    }
+}
+
+static void gain_process(struct dsp_gain* g, int32_t* buf, unsigned int frames)
+{
+  unsigned int i = 0;
+  unsigned int ch;
+  int32_t step;
+
+  // ramp per frame until the target is reached
+  while (g->current != g->target && i < frames)
+    {
+      step = (int32_t)(((int64_t)(g->target - g->current) * g->coef)
+                       >> DSP_UNITY_SHIFT);
+      step = (g->target - g->current) - step;
+      if (!step)
+        g->current = g->target;
+      else
+        g->current += step;
+
+      for (ch = 0; ch < DSP_CHANNELS; ch++)
+        {
+          buf[i * DSP_CHANNELS + ch] =
+            sat32(((int64_t)buf[i * DSP_CHANNELS + ch] * g->current)
+                  >> DSP_GAIN_SHIFT);
+        }
+      i++;
+    }
+
+  if (i < frames)
+    {
+      gain_block(buf + i * DSP_CHANNELS, (frames - i) * DSP_CHANNELS,
+                 g->target, g->limit);
+    }
+}
+
+int dsp_gain_set(struct dsp_stage* stage, double db)
+{
+  struct dsp_gain* g = &stage->u.gain;
+  double lin = pow(10.0, db / 20.0);
+
+  if (stage->type != DSP_STAGE_GAIN)
+    return -EINVAL;
+
+  // Q8.24 tops out just below 128 (+42 dB)
+  if (lin >= 127.0)
+    return -ERANGE;
+
+  g->target = (int32_t)lrint(lin * (1 << DSP_GAIN_SHIFT));
+  if (g->target <= (1 << DSP_GAIN_SHIFT))
+    g->limit = INT32_MAX;
+  else
+    g->limit = (int32_t)(((int64_t)INT32_MAX << DSP_GAIN_SHIFT) / g->target);
+
+  return 0;
+}
+
+/* Biquad */
+
+static void biquad_process(struct dsp_biquad* bq, int32_t* buf,
+                           unsigned int frames)
+{
+  unsigned int i, ch;
+  int32_t x;
+  int64_t acc, y;
+
+  for (ch = 0; ch < DSP_CHANNELS; ch++)
+    {
+      int32_t x1 = bq->x1[ch], x2 = bq->x2[ch];
+      int32_t y1 = bq->y1[ch], y2 = bq->y2[ch];
+      int64_t err = bq->err[ch];
+
+      for (i = 0; i < frames; i++)
+        {
+          x = buf[i * DSP_CHANNELS + ch];
+          acc = err
+            + (int64_t)bq->b0 * x + (int64_t)bq->b1 * x1 + (int64_t)bq->b2 * x2
+            - (int64_t)bq->a1 * y1 - (int64_t)bq->a2 * y2;
+          y = acc >> DSP_COEF_SHIFT;
+          // feed the truncation error into the next sample, the low bits
+          // are acc - (y << DSP_COEF_SHIFT) without shifting a negative y
+          err = acc & ((1ll << DSP_COEF_SHIFT) - 1);
+
+          x2 = x1;
+          x1 = x;
+          y2 = y1;
+          y1 = sat32(y);
+          buf[i * DSP_CHANNELS + ch] = y1;
+        }
+
+      bq->x1[ch] = x1;
+      bq->x2[ch] = x2;
+      bq->y1[ch] = y1;
+      bq->y2[ch] = y2;
+      bq->err[ch] = err;
+    }
+}
+
+/* @brief Compute biquad coefficients (RBJ audio EQ cookbook)
+   @return 0 on success, < 0 if the filter cannot be represented */
+static int biquad_design(struct dsp_biquad* bq, const char* kind,
+                         double freq, double q, double db,
+                         unsigned int sample_rate)
+{
+  double w0 = 2.0 * M_PI * freq / sample_rate;
+  double cw = cos(w0);
+  double alpha = sin(w0) / (2.0 * q);
+  double a = pow(10.0, db / 40.0);
+  double sa = 2.0 * sqrt(a) * alpha;
+  double b0, b1, b2, a0, a1, a2;
+  double c[5];
+  long long sum;
+  int i;
+
+  if (freq <= 0.0 || freq >= sample_rate / 2.0 || q <= 0.0)
+    return -EINVAL;
+
+  if (!strcmp(kind, "peak"))
+    {
+      b0 = 1.0 + alpha * a;
+      b1 = -2.0 * cw;
+      b2 = 1.0 - alpha * a;
+      a0 = 1.0 + alpha / a;
+      a1 = -2.0 * cw;
+      a2 = 1.0 - alpha / a;
+    }
+  else if (!strcmp(kind, "lowshelf"))
+    {
+      b0 = a * ((a + 1.0) - (a - 1.0) * cw + sa);
+      b1 = 2.0 * a * ((a - 1.0) - (a + 1.0) * cw);
+      b2 = a * ((a + 1.0) - (a - 1.0) * cw - sa);
+      a0 = (a + 1.0) + (a - 1.0) * cw + sa;
+      a1 = -2.0 * ((a - 1.0) + (a + 1.0) * cw);
+      a2 = (a + 1.0) + (a - 1.0) * cw - sa;
+    }
+  else if (!strcmp(kind, "highshelf"))
+    {
+      b0 = a * ((a + 1.0) + (a - 1.0) * cw + sa);
+      b1 = -2.0 * a * ((a - 1.0) + (a + 1.0) * cw);
+      b2 = a * ((a + 1.0) + (a - 1.0) * cw - sa);
+      a0 = (a + 1.0) - (a - 1.0) * cw + sa;
+      a1 = 2.0 * ((a - 1.0) - (a + 1.0) * cw);
+      a2 = (a + 1.0) - (a - 1.0) * cw - sa;
+    }
+  else if (!strcmp(kind, "lowpass"))
+    {
+      b0 = (1.0 - cw) / 2.0;
+      b1 = 1.0 - cw;
+      b2 = (1.0 - cw) / 2.0;
+      a0 = 1.0 + alpha;
+      a1 = -2.0 * cw;
+      a2 = 1.0 - alpha;
+    }
+  else if (!strcmp(kind, "highpass"))
+    {
+      b0 = (1.0 + cw) / 2.0;
+      b1 = -(1.0 + cw);
+      b2 = (1.0 + cw) / 2.0;
+      a0 = 1.0 + alpha;
+      a1 = -2.0 * cw;
+      a2 = 1.0 - alpha;
+    }
+  else
+    {
+      return -EINVAL;
+    }
+
+  c[0] = b0 / a0;
+  c[1] = b1 / a0;
+  c[2] = b2 / a0;
+  c[3] = a1 / a0;
+  c[4] = a2 / a0;
+
+  // Q4.28 covers [-8, 8)
+  for (i = 0; i < 5; i++)
+    {
+      if (fabs(c[i]) >= 8.0)
+        return -ERANGE;
+    }
+
+  memset(bq, 0, sizeof(*bq));
+  bq->b0 = (int32_t)lrint(c[0] * (1 << DSP_COEF_SHIFT));
+  bq->b1 = (int32_t)lrint(c[1] * (1 << DSP_COEF_SHIFT));
+  bq->b2 = (int32_t)lrint(c[2] * (1 << DSP_COEF_SHIFT));
+  bq->a1 = (int32_t)lrint(c[3] * (1 << DSP_COEF_SHIFT));
+  bq->a2 = (int32_t)lrint(c[4] * (1 << DSP_COEF_SHIFT));
+
+  /* Every product in biquad_process() is at most |coef| * 2^31, and the
+     error term is below 2^28. The accumulator therefore stays below 2^63
+     as long as the coefficients sum to less than 16 in magnitude. A
+     high-gain, low-Q peak can reach that limit even though each
+     coefficient is in range on its own. */
+  sum = llabs(bq->b0) + llabs(bq->b1) + llabs(bq->b2)
+    + llabs(bq->a1) + llabs(bq->a2);
+  if (sum >= 16ll << DSP_COEF_SHIFT)
+    return -ERANGE;
+
+  return 0;
+}
+
+/* Limiter */
+
+static void limiter_process(struct dsp_limiter* lim, int32_t* buf,
+                            unsigned int frames)
+{
+  unsigned int i, ch;
+  int64_t peak, s, g;
+
+  for (i = 0; i < frames; i++)
+    {
+      peak = 0;
+      for (ch = 0; ch < DSP_CHANNELS; ch++)
+        {
+          s = buf[i * DSP_CHANNELS + ch];
+          if (s < 0)
+            s = -s;
+          if (s > peak)
+            peak = s;
+        }
+
+      if (peak >= lim->env)
+        lim->env = peak;
+      else
+        lim->env = (lim->env * lim->release) >> DSP_UNITY_SHIFT;
+
+      if (lim->env <= lim->threshold)
+        continue;
+
+      // env >= |sample| so the result never exceeds the threshold
+      g = (lim->threshold << DSP_UNITY_SHIFT) / lim->env;
+      for (ch = 0; ch < DSP_CHANNELS; ch++)
+        {
+          buf[i * DSP_CHANNELS + ch] =
+            (int32_t)((buf[i * DSP_CHANNELS + ch] * g) >> DSP_UNITY_SHIFT);
+        }
+    }
+}
+
+/* Chain */
+
+void dsp_chain_init(struct dsp_chain* chain, unsigned int sample_rate)
+{
+  memset(chain, 0, sizeof(*chain));
+  chain->sample_rate = sample_rate;
+}
+
+/* @brief Parse one configuration line into a new stage
+   @return 0 on success or empty line, < 0 on error */
+static int parse_stage(struct dsp_chain* chain, char* line)
+{
+  struct dsp_stage* st;
+  char kind[16];
+  double p[3];
+  int n, err;
+
+  // strip comments
+  line[strcspn(line, "#\n")] = '\0';
+
+  n = sscanf(line, "%15s %lf %lf %lf", kind, &p[0], &p[1], &p[2]);
+  if (n <= 0)
+    return 0;
+
+  if (chain->count == DSP_MAX_STAGES)
+    return -ENOSPC;
+
+  st = &chain->stages[chain->count];
+  memset(st, 0, sizeof(*st));
+  snprintf(st->name, sizeof(st->name), "%s", kind);
+
+  if (!strcmp(kind, "gain"))
+    {
+      // gain DB [SMOOTH_MS]
+      if (n < 2)
+        return -EINVAL;
+
+      st->type = DSP_STAGE_GAIN;
+      err = dsp_gain_set(st, p[0]);
+      if (err)
+        return err;
+      // fade in from silence, the ramp also keeps the stream start click-free
+      st->u.gain.current = 0;
+      st->u.gain.coef = time_to_coef(n > 2 ? p[1] : DSP_GAIN_SMOOTH_MS,
+                                     chain->sample_rate);
+    }
+  else if (!strcmp(kind, "limiter"))
+    {
+      // limiter THRESHOLD_DB RELEASE_MS
+      if (n < 3 || p[0] > 0.0)
+        return -EINVAL;
+
+      st->type = DSP_STAGE_LIMITER;
+      st->u.limiter.threshold = llrint(pow(10.0, p[0] / 20.0) * INT32_MAX);
+      st->u.limiter.release = time_to_coef(p[1], chain->sample_rate);
+    }
+  else
+    {
+      // FILTER FREQ Q [DB]
+      if (n < 3)
+        return -EINVAL;
+
+      st->type = DSP_STAGE_BIQUAD;
+      err = biquad_design(&st->u.biquad, kind, p[0], p[1],
+                          n > 3 ? p[2] : 0.0, chain->sample_rate);
+      if (err)
+        return err;
+    }
+
+  chain->count++;
+
+  return 0;
+}
+
+int dsp_chain_load(struct dsp_chain* chain, const char* path)
+{
+  FILE* fp;
+  char line[DSP_CONF_LINE_MAX];
+  unsigned int lineno = 0;
+  int err = 0;
+
+  if (!chain || !path)
+    return -EINVAL;
+
+  fp = fopen(path, "r");
+  if (!fp)
+    return -errno;
+
+  while (fgets(line, sizeof(line), fp))
+    {
+      lineno++;
+      err = parse_stage(chain, line);
+      if (err)
+        {
+          printf("%s:%u: invalid DSP stage (%s)\n", path, lineno,
+                 strerror(-err));
+          break;
+        }
+    }
+
+  fclose(fp);
+
+  return err;
+}
+
+void dsp_chain_process(struct dsp_chain* chain, int32_t* buf,
+                       unsigned int frames)
+{
+  struct dsp_stage* st;
+  uint64_t t0, t1;
+  unsigned int i;
+
+  if (!chain->count)
+    return;
+
+  t0 = now_ns();
+  for (i = 0; i < chain->count; i++)
+    {
+      st = &chain->stages[i];
+      switch (st->type)
+        {
+        case DSP_STAGE_GAIN:
+          gain_process(&st->u.gain, buf, frames);
+          break;
+        case DSP_STAGE_BIQUAD:
+          biquad_process(&st->u.biquad, buf, frames);
+          break;
+        case DSP_STAGE_LIMITER:
+          limiter_process(&st->u.limiter, buf, frames);
+          break;
+        }
+
+      t1 = now_ns();
+      st->ns += t1 - t0;
+      t0 = t1;
+    }
+
+  chain->frames += frames;
+}
+
+void dsp_chain_report(const struct dsp_chain* chain)
+{
+  double seconds;
+  double ns_per_sec;
+  unsigned int i;
+
+  if (!chain->count || !chain->frames)
+    return;
+
+  seconds = (double)chain->frames / chain->sample_rate;
+
+  printf("DSP cost over %.2f s of audio:\n", seconds);
+  for (i = 0; i < chain->count; i++)
+    {
+      ns_per_sec = chain->stages[i].ns / seconds;
+      printf("\t%2u %-10s %10.0f ns/s  %6.3f%% CPU\n", i,
+             chain->stages[i].name, ns_per_sec, ns_per_sec / 1e7);
+    }
+}
@@ -0,0 +1,101 @@
+#ifndef DSP_H
+#define DSP_H
+
+#include <stdint.h>
+
+// maximum number of stages in a chain
+#define DSP_MAX_STAGES 16
+
+// processing works on interleaved stereo, left-justified 32-bit words
+#define DSP_CHANNELS 2
+
+// fixed-point formats
+#define DSP_GAIN_SHIFT   24 // gains are Q8.24
+#define DSP_COEF_SHIFT   28 // biquad coefficients are Q4.28
+#define DSP_UNITY_SHIFT  31 // smoothing/release/limiter gains are Q1.31
+
+enum dsp_stage_type
+{
+  DSP_STAGE_GAIN,
+  DSP_STAGE_BIQUAD,
+  DSP_STAGE_LIMITER,
+};
+
+// gain with one-pole smoothing towards the target
+struct dsp_gain
+{
+  int32_t target;  // Q8.24
+  int32_t current; // Q8.24
+  int32_t coef;    // Q1.31 smoothing factor per frame
+  int32_t limit;   // input clamp so target * input fits 32 bits
+};
+
+// direct form I biquad with first-order error feedback
+struct dsp_biquad
+{
+  int32_t b0, b1, b2, a1, a2; // Q4.28, a0 normalized to 1
+  int32_t x1[DSP_CHANNELS], x2[DSP_CHANNELS];
+  int32_t y1[DSP_CHANNELS], y2[DSP_CHANNELS];
+  int64_t err[DSP_CHANNELS];
+};
+
+// stereo-linked peak limiter, instant attack and exponential release
+struct dsp_limiter
+{
+  int64_t threshold; // linear peak level
+  int32_t release;   // Q1.31 envelope decay per frame
+  int64_t env;
+};
+
+struct dsp_stage
+{
+  enum dsp_stage_type type;
+  char name[32];
+  union
+  {
+    struct dsp_gain gain;
+    struct dsp_biquad biquad;
+    struct dsp_limiter limiter;
+  } u;
+  // accumulated processing time
+  uint64_t ns;
+};
+
+struct dsp_chain
+{
+  struct dsp_stage stages[DSP_MAX_STAGES];
+  unsigned int count;
+  unsigned int sample_rate;
+  // frames processed, used for cost reporting
+  uint64_t frames;
+};
+
+/* @brief Initialize an empty chain (bypass)
+   @param chain chain to initialize
+   @param sample_rate stream sample rate in Hz */
+void dsp_chain_init(struct dsp_chain* chain, unsigned int sample_rate);
+
+/* @brief Load stages from a configuration file
+   @param chain initialized chain, stages are appended
+   @param path configuration file path
+   @return 0 on success, < 0 on error */
+int dsp_chain_load(struct dsp_chain* chain, const char* path);
+
+/* @brief Set a new target for a gain stage, reached smoothly
+   @param stage a DSP_STAGE_GAIN stage
+   @param db gain in dB
+   @return 0 on success, < 0 on error */
+int dsp_gain_set(struct dsp_stage* stage, double db);
+
+/* @brief Run a block through all stages in place
+   @param chain the chain, an empty chain returns immediately
+   @param buf interleaved stereo left-justified samples
+   @param frames number of frames in buf */
+void dsp_chain_process(struct dsp_chain* chain, int32_t* buf,
+                       unsigned int frames);
+
+/* @brief Print per-stage CPU cost
+   @param chain the chain */
+void dsp_chain_report(const struct dsp_chain* chain);
+
+#endif
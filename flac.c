@@ -0,0 +1,1028 @@
+
+#include "flac.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <endian.h>
+
+#define FLAC_MAGIC "fLaC"
+#define FLAC_META_STREAMINFO 0
+#define FLAC_META_SEEKTABLE  3
+#define FLAC_STREAMINFO_SIZE 34
+#define FLAC_SEEK_POINT_SIZE 18
+#define FLAC_SEEK_PLACEHOLDER UINT64_MAX
+
+// channel assignments past the independent ones (0-7)
+#define FLAC_CH_LEFT_SIDE  8
+#define FLAC_CH_SIDE_RIGHT 9
+#define FLAC_CH_MID_SIDE   10
+
+#define FLAC_SUBFRAME_CONSTANT 0
+#define FLAC_SUBFRAME_VERBATIM 1
+#define FLAC_SUBFRAME_FIXED    8  // 8 + order, order 0-4
+#define FLAC_SUBFRAME_LPC      32 // 31 + order, order 1-32
+#define FLAC_MAX_FIXED_ORDER 4
+#define FLAC_MAX_LPC_ORDER   32
+
+// frame header from the sync code up to and including the CRC-8
+#define FLAC_MAX_HEADER_SIZE 16
+// header, one constant subframe and the CRC-16
+#define FLAC_MIN_FRAME_SIZE 10
+// file data read ahead of the frame being decoded
+#define FLAC_READ_AHEAD 65536
+
+// sample size codes of the frame header, 0 means STREAMINFO
+static const uint32_t flac_sample_sizes[8] = { 0, 8, 12, 0, 16, 20, 24, 32 };
+
+static uint8_t crc8_table[256];
+static uint16_t crc16_table[256];
+static int crc_ready;
+
+static inline uint64_t now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* CRCs */
+
+// CRC-8 poly 0x07 over frame headers, CRC-16 poly 0x8005 over frames
+static void crc_init(void)
+{
+  unsigned int i, j;
+  uint8_t c8;
+  uint16_t c16;
+
+  for (i = 0; i < 256; i++)
+    {
+      c8 = i;
+      c16 = i << 8;
+      for (j = 0; j < 8; j++)
+        {
+          c8 = (c8 & 0x80) ? (c8 << 1) ^ 0x07 : c8 << 1;
+          c16 = (c16 & 0x8000) ? (c16 << 1) ^ 0x8005 : c16 << 1;
+        }
+      crc8_table[i] = c8;
+      crc16_table[i] = c16;
+    }
+
+  crc_ready = 1;
+}
+
+static uint8_t crc8(const uint8_t* p, size_t len)
+{
+  uint8_t crc = 0;
+
+  while (len--)
+    crc = crc8_table[crc ^ *p++];
+
+  return crc;
+}
+
+static uint16_t crc16(const uint8_t* p, size_t len)
+{
+  uint16_t crc = 0;
+
+  while (len--)
+    crc = (crc << 8) ^ crc16_table[(crc >> 8) ^ *p++];
+
+  return crc;
+}
+
+/* Bit reader */
+
+// MSB-first reader over a buffered frame
+struct flac_bits
+{
+  const uint8_t* p;   // next byte to load
+  const uint8_t* end;
+  uint64_t cache;     // upcoming bits, left-aligned
+  unsigned int count; // bits in cache that p has moved past
+};
+
+/* @brief Top up the cache to at least 57 bits */
+static inline void bits_refill(struct flac_bits* b)
+{
+  uint64_t v;
+
+  // one unaligned load, bits beyond count are the following bytes
+  if (b->p + 8 <= b->end)
+    {
+      memcpy(&v, b->p, sizeof(v));
+      b->cache |= be64toh(v) >> b->count;
+      b->p += (63 - b->count) >> 3;
+      b->count |= 56;
+      return;
+    }
+
+  // tail of the buffer, bytes past the end read as 0
+  while (b->count <= 56)
+    {
+      if (b->p < b->end)
+        b->cache |= (uint64_t)*b->p << (56 - b->count);
+      b->p++;
+      b->count += 8;
+    }
+}
+
+/* @brief Read n bits, n <= 32 */
+static inline uint32_t bits_read(struct flac_bits* b, unsigned int n)
+{
+  uint32_t v;
+
+  if (!n)
+    return 0;
+
+  bits_refill(b);
+  v = (uint32_t)(b->cache >> (64 - n));
+  b->cache <<= n;
+  b->count -= n;
+
+  return v;
+}
+
+/* @brief Read an n bit two's complement number, n <= 32 */
+static inline int32_t bits_read_signed(struct flac_bits* b, unsigned int n)
+{
+  if (!n)
+    return 0;
+
+  return (int32_t)(bits_read(b, n) << (32 - n)) >> (32 - n);
+}
+
+/* @brief Count 0 bits up to and including the terminating 1 */
+static uint32_t bits_unary(struct flac_bits* b)
+{
+  uint32_t q = 0;
+  unsigned int z;
+
+  for (;;)
+    {
+      bits_refill(b);
+      if (b->cache)
+        {
+          z = __builtin_clzll(b->cache);
+          if (z < b->count)
+            {
+              b->cache <<= z + 1;
+              b->count -= z + 1;
+              return q + z;
+            }
+        }
+
+      q += b->count;
+      b->cache = 0;
+      b->count = 0;
+
+      // ran off the frame, bits_overrun() reports it
+      if (b->p >= b->end + 8)
+        return q;
+    }
+}
+
+/* @brief Read a zigzag coded Rice number with parameter k */
+static inline int32_t bits_rice(struct flac_bits* b, unsigned int k)
+{
+  uint64_t c;
+  uint32_t v;
+  unsigned int z;
+
+  bits_refill(b);
+  z = b->cache ? __builtin_clzll(b->cache) : 64;
+
+  // common case: quotient and remainder are both in the cache
+  if (z + 1 + k <= b->count)
+    {
+      c = b->cache << z << 1;
+      v = (z << k) | (uint32_t)(c >> 1 >> (63 - k));
+      b->cache = c << k;
+      b->count -= z + 1 + k;
+    }
+  else
+    {
+      v = bits_unary(b) << k;
+      v |= bits_read(b, k);
+    }
+
+  return (int32_t)(v >> 1) ^ -(int32_t)(v & 1);
+}
+
+// first byte not completely consumed
+static inline const uint8_t* bits_byte_pos(const struct flac_bits* b)
+{
+  return b->p - (b->count >> 3);
+}
+
+static inline int bits_overrun(const struct flac_bits* b)
+{
+  return bits_byte_pos(b) > b->end;
+}
+
+/* Frames */
+
+struct flac_frame_header
+{
+  uint32_t block_size;
+  uint32_t channels;
+  uint32_t assignment;
+  uint32_t bits_per_sample;
+  uint64_t number; // frame number, first sample for variable block sizes
+  int variable;
+  size_t size;     // bytes including the CRC-8
+};
+
+/* @brief Parse the frame header at p, up to FLAC_MAX_HEADER_SIZE bytes
+   may be looked at
+   @return 0 on success, < 0 if p does not start a usable header */
+static int parse_frame_header(const struct flac_decoder* dec, const uint8_t* p,
+                              struct flac_frame_header* h)
+{
+  unsigned int bs_code, sr_code, ss_code, extra, mask;
+  size_t n = 4;
+  uint8_t c;
+
+  if (p[0] != 0xFF || (p[1] & 0xFE) != 0xF8)
+    return -EINVAL;
+
+  h->variable = p[1] & 1;
+  bs_code = p[2] >> 4;
+  sr_code = p[2] & 0xF;
+  h->assignment = p[3] >> 4;
+  ss_code = (p[3] >> 1) & 7;
+
+  if (!bs_code || sr_code == 15 || h->assignment > FLAC_CH_MID_SIDE ||
+      ss_code == 3 || (p[3] & 1))
+    return -EINVAL;
+
+  // frame/sample number, UTF-8 style with up to 6 continuation bytes
+  c = p[n++];
+  extra = 0;
+  mask = 0x40;
+  if (c & 0x80)
+    {
+      while (c & mask)
+        {
+          extra++;
+          mask >>= 1;
+        }
+      if (!extra || extra > 6)
+        return -EINVAL;
+    }
+  else
+    {
+      mask = 0x80;
+    }
+
+  h->number = c & (mask - 1);
+  while (extra--)
+    {
+      c = p[n++];
+      if ((c & 0xC0) != 0x80)
+        return -EINVAL;
+      h->number = (h->number << 6) | (c & 0x3F);
+    }
+
+  if (bs_code == 1)
+    h->block_size = 192;
+  else if (bs_code <= 5)
+    h->block_size = 576 << (bs_code - 2);
+  else if (bs_code == 6)
+    h->block_size = p[n++] + 1;
+  else if (bs_code == 7)
+    {
+      h->block_size = ((p[n] << 8) | p[n + 1]) + 1;
+      n += 2;
+    }
+  else
+    h->block_size = 256 << (bs_code - 8);
+
+  // the rate is taken from STREAMINFO, skip any explicit one
+  if (sr_code == 12)
+    n += 1;
+  else if (sr_code == 13 || sr_code == 14)
+    n += 2;
+
+  if (crc8(p, n) != p[n])
+    return -EINVAL;
+  h->size = n + 1;
+
+  h->channels = h->assignment < FLAC_CH_LEFT_SIDE ? h->assignment + 1 : 2;
+  h->bits_per_sample = ss_code ? flac_sample_sizes[ss_code] : dec->info.bits_per_sample;
+
+  // buffers and output layout follow STREAMINFO
+  if (h->block_size > dec->info.max_block_size ||
+      h->channels != dec->info.channels ||
+      h->bits_per_sample != dec->info.bits_per_sample)
+    return -EINVAL;
+
+  return 0;
+}
+
+/* @brief Decode the residual of a predicted subframe
+   @param out samples, residuals are stored from out[order] on
+   @param n samples in the block
+   @param order predictor order, that many warm-up samples precede
+   @return 0 on success, < 0 on error */
+static int decode_residual(struct flac_bits* b, int32_t* out, uint32_t n,
+                           uint32_t order)
+{
+  uint32_t method, param_bits, escape, porder, psize, count, k, raw, p, i, j;
+
+  method = bits_read(b, 2);
+  if (method > 1)
+    return -EIO;
+
+  param_bits = method ? 5 : 4;
+  escape = (1u << param_bits) - 1;
+
+  porder = bits_read(b, 4);
+  psize = n >> porder;
+  if ((psize << porder) != n || psize < order)
+    return -EIO;
+
+  i = order;
+  for (p = 0; p < (1u << porder); p++)
+    {
+      count = p ? psize : psize - order;
+      k = bits_read(b, param_bits);
+
+      if (k == escape)
+        {
+          // unencoded partition, raw may be 0 for all zeros
+          raw = bits_read(b, 5);
+          for (j = 0; j < count; j++)
+            out[i++] = bits_read_signed(b, raw);
+        }
+      else
+        {
+          for (j = 0; j < count; j++)
+            out[i++] = bits_rice(b, k);
+        }
+    }
+
+  return bits_overrun(b) ? -EIO : 0;
+}
+
+static int decode_fixed(struct flac_bits* b, int32_t* out, uint32_t n,
+                        uint32_t bps, uint32_t order)
+{
+  // wrapping arithmetic, the final samples fit in bps
+  uint32_t* u = (uint32_t*)out;
+  uint32_t i;
+  int err;
+
+  if (order > n)
+    return -EIO;
+
+  for (i = 0; i < order; i++)
+    out[i] = bits_read_signed(b, bps);
+
+  err = decode_residual(b, out, n, order);
+  if (err)
+    return err;
+
+  switch (order)
+    {
+    case 1:
+      for (i = 1; i < n; i++)
+        u[i] += u[i - 1];
+      break;
+    case 2:
+      for (i = 2; i < n; i++)
+        u[i] += 2 * u[i - 1] - u[i - 2];
+      break;
+    case 3:
+      for (i = 3; i < n; i++)
+        u[i] += 3 * (u[i - 1] - u[i - 2]) + u[i - 3];
+      break;
+    case 4:
+      for (i = 4; i < n; i++)
+        u[i] += 4 * (u[i - 1] + u[i - 3]) - 6 * u[i - 2] - u[i - 4];
+      break;
+    default:
+      break;
+    }
+
+  return 0;
+}
+
+/* @brief LPC prediction with 32-bit sums, when valid products cannot
+   overflow. Sums wrap instead, prediction runs before the CRC-16 check
+   so damaged frames must not hit signed overflow.
+   @param rcoefs coefficients in history order, oldest sample first */
+static void lpc_predict32(int32_t* out, uint32_t n, const int32_t* rcoefs,
+                          uint32_t order, int shift)
+{
+  const int32_t* hist;
+  uint32_t sum;
+  uint32_t i, j;
+
+  for (i = order; i < n; i++)
+    {
+      hist = out + i - order;
+      sum = 0;
+      for (j = 0; j < order; j++)
+        sum += (uint32_t)rcoefs[j] * (uint32_t)hist[j];
+      out[i] = (int32_t)((uint32_t)out[i] + (uint32_t)((int32_t)sum >> shift));
+    }
+}
+
+static void lpc_predict64(int32_t* out, uint32_t n, const int32_t* rcoefs,
+                          uint32_t order, int shift)
+{
+  const int32_t* hist;
+  uint64_t sum;
+  uint32_t i, j;
+
+  // products fit, 32 of them may not on damaged frames
+  for (i = order; i < n; i++)
+    {
+      hist = out + i - order;
+      sum = 0;
+      for (j = 0; j < order; j++)
+        sum += (uint64_t)((int64_t)rcoefs[j] * hist[j]);
+      out[i] = (int32_t)((uint32_t)out[i] + (uint32_t)((int64_t)sum >> shift));
+    }
+}
+
+static int decode_lpc(struct flac_bits* b, int32_t* out, uint32_t n,
+                      uint32_t bps, uint32_t order)
+{
+  int32_t rcoefs[FLAC_MAX_LPC_ORDER];
+  uint32_t precision, i;
+  int32_t shift;
+  int err;
+
+  if (order > n)
+    return -EIO;
+
+  for (i = 0; i < order; i++)
+    out[i] = bits_read_signed(b, bps);
+
+  precision = bits_read(b, 4) + 1;
+  shift = bits_read_signed(b, 5);
+  if (precision == 16 || shift < 0)
+    return -EIO;
+
+  // stored newest sample first, kept oldest first for the inner loop
+  for (i = 0; i < order; i++)
+    rcoefs[order - 1 - i] = bits_read_signed(b, precision);
+
+  err = decode_residual(b, out, n, order);
+  if (err)
+    return err;
+
+  // 24-bit material with the usual 12-15 bit coefficients needs 64 bits
+  if (bps + precision + (32 - __builtin_clz(order)) <= 32)
+    lpc_predict32(out, n, rcoefs, order, shift);
+  else
+    lpc_predict64(out, n, rcoefs, order, shift);
+
+  return 0;
+}
+
+static int decode_subframe(struct flac_bits* b, int32_t* out, uint32_t n,
+                           uint32_t bps)
+{
+  uint32_t type, wasted = 0, i;
+  int32_t v;
+  int err = 0;
+
+  // zero pad bit
+  if (bits_read(b, 1))
+    return -EIO;
+
+  type = bits_read(b, 6);
+
+  // low bits that are 0 in every sample are not coded
+  if (bits_read(b, 1))
+    {
+      wasted = bits_unary(b) + 1;
+      if (wasted >= bps)
+        return -EIO;
+      bps -= wasted;
+    }
+
+  if (type == FLAC_SUBFRAME_CONSTANT)
+    {
+      v = bits_read_signed(b, bps);
+      for (i = 0; i < n; i++)
+        out[i] = v;
+    }
+  else if (type == FLAC_SUBFRAME_VERBATIM)
+    {
+      for (i = 0; i < n; i++)
+        out[i] = bits_read_signed(b, bps);
+    }
+  else if (type >= FLAC_SUBFRAME_FIXED &&
+           type <= FLAC_SUBFRAME_FIXED + FLAC_MAX_FIXED_ORDER)
+    {
+      err = decode_fixed(b, out, n, bps, type - FLAC_SUBFRAME_FIXED);
+    }
+  else if (type >= FLAC_SUBFRAME_LPC)
+    {
+      err = decode_lpc(b, out, n, bps, type - FLAC_SUBFRAME_LPC + 1);
+    }
+  else
+    {
+      return -EIO;
+    }
+
+  if (err)
+    return err;
+
+  if (wasted)
+    {
+      for (i = 0; i < n; i++)
+        out[i] = (int32_t)((uint32_t)out[i] << wasted);
+    }
+
+  return bits_overrun(b) ? -EIO : 0;
+}
+
+/* @brief Decode subframes and footer of a buffered frame
+   @param frame first byte of the frame header
+   @param end end of the buffered data
+   @param frame_size destination, bytes in the frame
+   @return 0 on success, < 0 if the frame is damaged */
+static int decode_frame_body(struct flac_decoder* dec,
+                             const struct flac_frame_header* h,
+                             const uint8_t* frame, const uint8_t* end,
+                             size_t* frame_size)
+{
+  struct flac_bits b = {
+    .p = frame + h->size,
+    .end = end,
+    .cache = 0,
+    .count = 0,
+  };
+  const uint8_t* footer;
+  int32_t *ch0 = dec->samples[0], *ch1 = dec->samples[1];
+  int64_t mid, side;
+  uint32_t bps, ch, i;
+  int err;
+
+  for (ch = 0; ch < h->channels; ch++)
+    {
+      // the side channel carries one extra bit
+      bps = h->bits_per_sample;
+      if ((h->assignment == FLAC_CH_LEFT_SIDE && ch == 1) ||
+          (h->assignment == FLAC_CH_SIDE_RIGHT && ch == 0) ||
+          (h->assignment == FLAC_CH_MID_SIDE && ch == 1))
+        bps++;
+
+      if (bps > 32)
+        return -ENOTSUP;
+
+      err = decode_subframe(&b, dec->samples[ch], h->block_size, bps);
+      if (err)
+        return err;
+    }
+
+  // zero padding up to the byte boundary, then CRC-16 of everything before
+  bits_read(&b, b.count & 7);
+  footer = bits_byte_pos(&b);
+  if (footer + 2 > end || bits_read(&b, 16) != crc16(frame, footer - frame))
+    return -EIO;
+
+  *frame_size = footer + 2 - frame;
+
+  switch (h->assignment)
+    {
+    // wrapping arithmetic, valid frames stay within bps
+    case FLAC_CH_LEFT_SIDE:
+      for (i = 0; i < h->block_size; i++)
+        ch1[i] = (int32_t)((uint32_t)ch0[i] - (uint32_t)ch1[i]);
+      break;
+    case FLAC_CH_SIDE_RIGHT:
+      for (i = 0; i < h->block_size; i++)
+        ch0[i] = (int32_t)((uint32_t)ch0[i] + (uint32_t)ch1[i]);
+      break;
+    case FLAC_CH_MID_SIDE:
+      // 31-bit streams need the 64-bit intermediate
+      for (i = 0; i < h->block_size; i++)
+        {
+          side = ch1[i];
+          mid = ((int64_t)ch0[i] * 2) | (side & 1);
+          ch0[i] = (int32_t)((mid + side) >> 1);
+          ch1[i] = (int32_t)((mid - side) >> 1);
+        }
+      break;
+    default:
+      break;
+    }
+
+  return 0;
+}
+
+/* Stream */
+
+/* @brief Make sure a whole frame is buffered unless the file ends first
+   @return 0 on success, < 0 on a read error */
+static int buffer_fill(struct flac_decoder* dec)
+{
+  size_t n;
+
+  // keep the unread tail, move it to the front
+  if (dec->pos)
+    {
+      memmove(dec->buf, dec->buf + dec->pos, dec->len - dec->pos);
+      dec->buf_offset += dec->pos;
+      dec->len -= dec->pos;
+      dec->pos = 0;
+    }
+
+  while (!dec->eof && dec->len < dec->size)
+    {
+      n = fread(dec->buf + dec->len, 1, dec->size - dec->len, dec->fp);
+      if (!n)
+        {
+          if (ferror(dec->fp))
+            return -EIO;
+          dec->eof = 1;
+        }
+      dec->len += n;
+    }
+
+  // header parsing may look past the end
+  memset(dec->buf + dec->len, 0, FLAC_MAX_HEADER_SIZE);
+
+  return 0;
+}
+
+/* @brief Drop buffered data and continue reading at a file offset */
+static int buffer_seek(struct flac_decoder* dec, off_t offset)
+{
+  if (fseeko(dec->fp, offset, SEEK_SET))
+    return -errno;
+
+  dec->buf_offset = offset;
+  dec->len = 0;
+  dec->pos = 0;
+  dec->eof = 0;
+  dec->block_size = 0;
+  dec->block_pos = 0;
+
+  return 0;
+}
+
+int flac_decode_frame(struct flac_decoder* dec)
+{
+  struct flac_frame_header h;
+  const uint8_t* p;
+  const uint8_t* sync;
+  uint64_t start_ns = now_ns();
+  size_t frame_size;
+  int lost = 0;
+  int err;
+
+  for (;;)
+    {
+      if (dec->len - dec->pos < dec->frame_bound && !dec->eof)
+        {
+          err = buffer_fill(dec);
+          if (err)
+            return err;
+        }
+
+      if (dec->len - dec->pos < FLAC_MIN_FRAME_SIZE)
+        break;
+
+      p = dec->buf + dec->pos;
+      if (!parse_frame_header(dec, p, &h))
+        {
+          if (h.size < dec->len - dec->pos &&
+              !decode_frame_body(dec, &h, p, dec->buf + dec->len, &frame_size))
+            {
+              dec->block_offset = dec->buf_offset + dec->pos;
+              dec->pos += frame_size;
+              dec->block_size = h.block_size;
+              dec->block_pos = 0;
+              dec->block_start = h.variable ? h.number
+                : h.number * dec->info.max_block_size;
+              dec->resyncs += lost;
+              dec->frames_decoded += h.block_size;
+              dec->ns += now_ns() - start_ns;
+              return h.block_size;
+            }
+
+          dec->bad_frames++;
+        }
+
+      // not a frame here, look for the next sync code
+      lost = 1;
+      dec->pos++;
+      sync = memchr(dec->buf + dec->pos, 0xFF, dec->len - dec->pos);
+      dec->pos = sync ? (size_t)(sync - dec->buf) : dec->len;
+    }
+
+  dec->block_size = 0;
+  dec->block_pos = 0;
+  dec->ns += now_ns() - start_ns;
+
+  return 0;
+}
+
+size_t flac_read_frames(struct flac_decoder* dec, int32_t* out, size_t frames)
+{
+  unsigned int shift = 32 - dec->info.bits_per_sample;
+  uint32_t ch, channels = dec->info.channels;
+  size_t done = 0, n, i;
+  const int32_t* s;
+
+  while (done < frames)
+    {
+      if (dec->block_pos == dec->block_size && flac_decode_frame(dec) <= 0)
+        break;
+
+      n = dec->block_size - dec->block_pos;
+      if (n > frames - done)
+        n = frames - done;
+
+      // interleave and left-justify
+      for (ch = 0; ch < channels; ch++)
+        {
+          s = dec->samples[ch] + dec->block_pos;
+          for (i = 0; i < n; i++)
+            out[i * channels + ch] = (int32_t)((uint32_t)s[i] << shift);
+        }
+
+      out += n * channels;
+      dec->block_pos += n;
+      done += n;
+    }
+
+  return done;
+}
+
+int flac_seek(struct flac_decoder* dec, uint64_t frame)
+{
+  struct flac_seek_point best = { 0, dec->first_frame };
+  unsigned int i;
+  int ret;
+
+  if (dec->info.total_samples && frame >= dec->info.total_samples)
+    return -EINVAL;
+
+  // target is in the block already decoded
+  if (dec->block_size && frame >= dec->block_start &&
+      frame < dec->block_start + dec->block_size)
+    {
+      dec->block_pos = frame - dec->block_start;
+      return 0;
+    }
+
+  // closest known frame start at or before the target
+  for (i = 0; i < dec->seek_count; i++)
+    {
+      if (dec->seek_points[i].sample <= frame &&
+          dec->seek_points[i].sample >= best.sample)
+        best = dec->seek_points[i];
+    }
+
+  if (dec->have_mark && dec->mark.sample <= frame && dec->mark.sample >= best.sample)
+    best = dec->mark;
+
+  // decoding on from here is no worse than jumping back
+  if (!dec->block_size || dec->block_start < best.sample || dec->block_start > frame)
+    {
+      ret = buffer_seek(dec, best.offset);
+      if (ret)
+        return ret;
+    }
+
+  do
+    {
+      ret = flac_decode_frame(dec);
+      if (ret <= 0)
+        return ret ? ret : -ENODATA;
+    }
+  while (frame >= dec->block_start + dec->block_size);
+
+  // a seek point led past the target
+  if (frame < dec->block_start)
+    return -EIO;
+
+  dec->block_pos = frame - dec->block_start;
+  dec->mark.sample = dec->block_start;
+  dec->mark.offset = dec->block_offset;
+  dec->have_mark = 1;
+
+  return 0;
+}
+
+/* @brief Parse the STREAMINFO block body */
+static void parse_stream_info(const uint8_t* si, struct flac_stream_info* info)
+{
+  info->min_block_size = (si[0] << 8) | si[1];
+  info->max_block_size = (si[2] << 8) | si[3];
+  info->min_frame_size = (si[4] << 16) | (si[5] << 8) | si[6];
+  info->max_frame_size = (si[7] << 16) | (si[8] << 8) | si[9];
+  info->sample_rate = (si[10] << 12) | (si[11] << 4) | (si[12] >> 4);
+  info->channels = ((si[12] >> 1) & 7) + 1;
+  info->bits_per_sample = (((si[12] & 1) << 4) | (si[13] >> 4)) + 1;
+  info->total_samples = ((uint64_t)(si[13] & 0xF) << 32) |
+    ((uint32_t)si[14] << 24) | (si[15] << 16) | (si[16] << 8) | si[17];
+}
+
+/* @brief Read the SEEKTABLE block body, placeholder points are dropped
+   @return 0 on success, < 0 on error */
+static int parse_seek_table(struct flac_decoder* dec, uint32_t len)
+{
+  uint8_t sp[FLAC_SEEK_POINT_SIZE];
+  uint32_t i, count = len / FLAC_SEEK_POINT_SIZE;
+  uint64_t sample, offset;
+  unsigned int j;
+
+  dec->seek_points = calloc(count ? count : 1, sizeof(*dec->seek_points));
+  if (!dec->seek_points)
+    return -ENOMEM;
+
+  for (i = 0; i < count; i++)
+    {
+      if (fread(sp, 1, sizeof(sp), dec->fp) != sizeof(sp))
+        return -ENODATA;
+
+      sample = offset = 0;
+      for (j = 0; j < 8; j++)
+        {
+          sample = (sample << 8) | sp[j];
+          offset = (offset << 8) | sp[8 + j];
+        }
+
+      if (sample == FLAC_SEEK_PLACEHOLDER)
+        continue;
+
+      // relative to the first frame until that is known
+      dec->seek_points[dec->seek_count].sample = sample;
+      dec->seek_points[dec->seek_count].offset = offset;
+      dec->seek_count++;
+    }
+
+  return 0;
+}
+
+int flac_open(struct flac_decoder* dec, FILE* fp)
+{
+  struct flac_stream_info* info = &dec->info;
+  uint8_t head[10];
+  uint8_t si[FLAC_STREAMINFO_SIZE];
+  off_t start = 0;
+  uint32_t type, len, i;
+  size_t verbatim;
+  int have_info = 0;
+  int last;
+  int err;
+
+  memset(dec, 0, sizeof(*dec));
+  dec->fp = fp;
+
+  if (!crc_ready)
+    crc_init();
+
+  if (fseeko(fp, 0, SEEK_SET))
+    return -errno;
+
+  if (fread(head, 1, sizeof(head), fp) != sizeof(head))
+    return -EINVAL;
+
+  // ID3v2 tags are sometimes put in front, the size is 7 bits per byte
+  if (!memcmp(head, "ID3", 3))
+    {
+      start = 10 + (((head[6] & 0x7F) << 21) | ((head[7] & 0x7F) << 14) |
+                    ((head[8] & 0x7F) << 7) | (head[9] & 0x7F));
+      if (fseeko(fp, start, SEEK_SET) || fread(head, 1, 4, fp) != 4)
+        return -EINVAL;
+    }
+
+  if (memcmp(head, FLAC_MAGIC, 4))
+    return -EINVAL;
+
+  if (fseeko(fp, start + 4, SEEK_SET))
+    return -errno;
+
+  do
+    {
+      if (fread(head, 1, 4, fp) != 4)
+        {
+          err = -ENODATA;
+          goto fail;
+        }
+
+      last = head[0] & 0x80;
+      type = head[0] & 0x7F;
+      len = (head[1] << 16) | (head[2] << 8) | head[3];
+
+      if (type == FLAC_META_STREAMINFO && !have_info)
+        {
+          if (len < sizeof(si) || fread(si, 1, sizeof(si), fp) != sizeof(si))
+            {
+              err = -ENODATA;
+              goto fail;
+            }
+          parse_stream_info(si, info);
+          have_info = 1;
+          len -= sizeof(si);
+        }
+      else if (type == FLAC_META_SEEKTABLE && !dec->seek_points)
+        {
+          err = parse_seek_table(dec, len);
+          if (err)
+            goto fail;
+          len %= FLAC_SEEK_POINT_SIZE;
+        }
+
+      // everything else (tags, pictures, padding) is skipped
+      if (len && fseeko(fp, len, SEEK_CUR))
+        {
+          err = -errno;
+          goto fail;
+        }
+    }
+  while (!last);
+
+  if (!have_info || info->channels > FLAC_MAX_CHANNELS ||
+      info->bits_per_sample < 4 || info->bits_per_sample > 32 ||
+      info->max_block_size < 16 || !info->sample_rate)
+    {
+      err = -ENOTSUP;
+      goto fail;
+    }
+
+  dec->first_frame = ftello(fp);
+  for (i = 0; i < dec->seek_count; i++)
+    dec->seek_points[i].offset += dec->first_frame;
+
+  // a verbatim frame is the largest an encoder should produce
+  verbatim = (size_t)info->max_block_size * info->channels *
+    (info->bits_per_sample + 1) / 8 + info->channels * 8;
+  dec->frame_bound = verbatim > info->max_frame_size ? verbatim : info->max_frame_size;
+  dec->frame_bound += FLAC_MAX_HEADER_SIZE + 2;
+
+  dec->size = dec->frame_bound + FLAC_READ_AHEAD;
+  dec->buf = malloc(dec->size + FLAC_MAX_HEADER_SIZE);
+  if (!dec->buf)
+    {
+      err = -ENOMEM;
+      goto fail;
+    }
+
+  for (i = 0; i < info->channels; i++)
+    {
+      dec->samples[i] = malloc(info->max_block_size * sizeof(int32_t));
+      if (!dec->samples[i])
+        {
+          err = -ENOMEM;
+          goto fail;
+        }
+    }
+
+  // file is positioned at the first frame
+  dec->buf_offset = dec->first_frame;
+
+  return 0;
+
+fail:
+  flac_close(dec);
+  return err;
+}
+
+void flac_report(const struct flac_decoder* dec)
+{
+  double seconds;
+  double ns_per_sec;
+
+  if (!dec->frames_decoded)
+    return;
+
+  seconds = (double)dec->frames_decoded / dec->info.sample_rate;
+  ns_per_sec = dec->ns / seconds;
+
+  printf("FLAC decode over %.2f s of audio: %10.0f ns/s  %6.3f%% CPU",
+         seconds, ns_per_sec, ns_per_sec / 1e7);
+  if (dec->resyncs || dec->bad_frames)
+    printf(", %u resync(s), %u bad frame(s)", dec->resyncs, dec->bad_frames);
+  printf("\n");
+}
+
+void flac_close(struct flac_decoder* dec)
+{
+  unsigned int i;
+
+  for (i = 0; i < FLAC_MAX_CHANNELS; i++)
+    {
+      free(dec->samples[i]);
+      dec->samples[i] = NULL;
+    }
+
+  free(dec->buf);
+  dec->buf = NULL;
+  free(dec->seek_points);
+  dec->seek_points = NULL;
+  dec->seek_count = 0;
+}
@@ -0,0 +1,99 @@
+#ifndef FLAC_H
+#define FLAC_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// largest channel count decoded, one stereo pair per zone
+#define FLAC_MAX_CHANNELS 8
+
+// STREAMINFO metadata block
+struct flac_stream_info
+{
+  uint32_t min_block_size;  // frames
+  uint32_t max_block_size;  // frames
+  uint32_t min_frame_size;  // bytes, 0 if unknown
+  uint32_t max_frame_size;  // bytes, 0 if unknown
+  uint32_t sample_rate;     // Hz
+  uint32_t channels;
+  uint32_t bits_per_sample;
+  uint64_t total_samples;   // frames in the stream, 0 if unknown
+};
+
+// SEEKTABLE entry, also used to remember where a seek landed
+struct flac_seek_point
+{
+  uint64_t sample; // first frame of the FLAC frame
+  off_t offset;    // file offset of its header
+};
+
+struct flac_decoder
+{
+  FILE* fp;
+  struct flac_stream_info info;
+
+  // file data, a whole FLAC frame is buffered before it is decoded
+  uint8_t* buf;
+  size_t size;
+  size_t len;
+  size_t pos;
+  size_t frame_bound; // refill when less than this is buffered
+  off_t buf_offset;   // file offset of buf[0]
+  int eof;
+
+  off_t first_frame; // file offset of the first frame header
+
+  struct flac_seek_point* seek_points;
+  unsigned int seek_count;
+  // frame holding the last seek target, loops back to it decode one frame
+  struct flac_seek_point mark;
+  int have_mark;
+
+  // decoded block, one array per channel, right-justified samples
+  int32_t* samples[FLAC_MAX_CHANNELS];
+  uint32_t block_size; // frames in samples
+  uint32_t block_pos;  // frames already handed out
+  uint64_t block_start; // stream frame of samples[][0]
+  off_t block_offset;   // file offset of the frame header
+
+  // statistics
+  unsigned int resyncs;   // times the frame sync was lost
+  unsigned int bad_frames; // frames dropped for a bad CRC or syntax
+  uint64_t frames_decoded;
+  uint64_t ns; // time spent decoding
+};
+
+/* @brief Read the metadata and get ready to decode the first frame
+   @param dec decoder to initialize
+   @param fp file, may be positioned anywhere
+   @return 0 on success, -EINVAL if this is not a FLAC file, < 0 on error */
+int flac_open(struct flac_decoder* dec, FILE* fp);
+
+/* @brief Decode the next FLAC frame into dec->samples
+   @param dec an opened decoder
+   @return frames decoded, 0 at the end of the stream, < 0 on error */
+int flac_decode_frame(struct flac_decoder* dec);
+
+/* @brief Read interleaved, left-justified 32-bit samples
+   @param dec an opened decoder
+   @param out destination, frames * channels words
+   @param frames frames to read
+   @return frames read, fewer at the end of the stream */
+size_t flac_read_frames(struct flac_decoder* dec, int32_t* out, size_t frames);
+
+/* @brief Continue reading at a stream frame. Starts from the closest
+   seek point, the frame that held the target is remembered so seeking
+   there again only decodes one frame.
+   @param dec an opened decoder
+   @param frame stream frame
+   @return 0 on success, < 0 on error */
+int flac_seek(struct flac_decoder* dec, uint64_t frame);
+
+/* @brief Print decode cost
+   @param dec the decoder */
+void flac_report(const struct flac_decoder* dec);
+
+void flac_close(struct flac_decoder* dec);
+
+#endif
@@ -0,0 +1,201 @@
+/* Measure FLAC decode speed on the target without touching the audio path.
+   Decodes the whole file RUNS times and reports the best run, the share
+   of one core needed for real-time playback is the figure to watch:
+
+     ./flacbench -n 5 file.flac
+
+   Build for the host with
+
+     make flacbench CROSS_COMPILE=x86_64-linux-gnu
+
+   -o dumps the decoded stream as interleaved left-justified S32_LE words,
+   the same samples the player feeds to the DSP chain. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "flac.h"
+
+// frames per flac_read_frames() call, a player block
+#define BENCH_BLOCK_FRAMES 256
+
+void pr_usage(char* pname)
+{
+  printf("usage: %s [-n RUNS] [-s START_FRAME] [-o RAW_FILE] FLAC_FILE\n", pname);
+}
+
+static double clock_ms(clockid_t clock)
+{
+  struct timespec ts;
+
+  clock_gettime(clock, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/* @brief Decode the stream once
+   @param dec opened decoder
+   @param start first frame
+   @param out raw output, NULL to discard
+   @param sum destination, checksum of the decoded words
+   @return frames decoded, < 0 on error */
+static int64_t decode_all(struct flac_decoder* dec, uint64_t start, FILE* out,
+                          uint32_t* sum)
+{
+  int32_t buf[BENCH_BLOCK_FRAMES * FLAC_MAX_CHANNELS];
+  size_t n, i, words;
+  int64_t frames = 0;
+  uint32_t h = 2166136261u;
+  int err;
+
+  if (start)
+    {
+      err = flac_seek(dec, start);
+      if (err)
+        return err;
+    }
+
+  while ((n = flac_read_frames(dec, buf, BENCH_BLOCK_FRAMES)) > 0)
+    {
+      words = n * dec->info.channels;
+
+      // FNV-1a over the words, cheap next to decoding
+      for (i = 0; i < words; i++)
+        h = (h ^ (uint32_t)buf[i]) * 16777619u;
+
+      if (out && fwrite(buf, sizeof(int32_t), words, out) != words)
+        return -EIO;
+
+      frames += n;
+    }
+
+  *sum = h;
+  return frames;
+}
+
+int main(int argc, char** argv)
+{
+  struct flac_decoder dec;
+  const char* out_path = NULL;
+  FILE* fp;
+  FILE* out = NULL;
+  unsigned int runs = 3, r;
+  uint64_t start = 0;
+  int64_t frames = 0;
+  uint32_t sum = 0;
+  double wall, cpu, best_wall = 0.0, best_cpu = 0.0, seconds;
+  int opt;
+  int err;
+
+  while ((opt = getopt(argc, argv, "n:o:s:")) != -1)
+    {
+      switch (opt)
+        {
+        case 'n':
+          runs = strtoul(optarg, NULL, 10);
+          break;
+        case 'o':
+          out_path = optarg;
+          break;
+        case 's':
+          start = strtoull(optarg, NULL, 10);
+          break;
+        default:
+          pr_usage(argv[0]);
+          return 1;
+        }
+    }
+
+  if (optind >= argc || !runs)
+    {
+      pr_usage(argv[0]);
+      return 1;
+    }
+
+  fp = fopen(argv[optind], "r");
+  if (!fp)
+    {
+      printf("Could not open %s\n", argv[optind]);
+      return 1;
+    }
+
+  if (out_path)
+    {
+      out = fopen(out_path, "w");
+      if (!out)
+        {
+          printf("Could not open %s\n", out_path);
+          fclose(fp);
+          return 1;
+        }
+    }
+
+  for (r = 0; r < runs; r++)
+    {
+      err = flac_open(&dec, fp);
+      if (err)
+        {
+          printf("Could not open FLAC stream %s: %d\n", argv[optind], -err);
+          break;
+        }
+
+      if (!r)
+        printf("%s: %u ch, %u Hz, %u bit, blocks of %u-%u frames\n",
+               argv[optind], dec.info.channels, dec.info.sample_rate,
+               dec.info.bits_per_sample, dec.info.min_block_size,
+               dec.info.max_block_size);
+
+      wall = clock_ms(CLOCK_MONOTONIC);
+      cpu = clock_ms(CLOCK_PROCESS_CPUTIME_ID);
+
+      // only the first run is written out
+      frames = decode_all(&dec, start, r ? NULL : out, &sum);
+
+      wall = clock_ms(CLOCK_MONOTONIC) - wall;
+      cpu = clock_ms(CLOCK_PROCESS_CPUTIME_ID) - cpu;
+
+      if (frames < 0)
+        {
+          printf("Decode failed: %d\n", (int)-frames);
+          err = (int)frames;
+          flac_close(&dec);
+          break;
+        }
+
+      seconds = (double)frames / dec.info.sample_rate;
+      printf("run %u: %.2f ms wall, %.2f ms CPU, %.1fx real time\n",
+             r + 1, wall, cpu, seconds * 1e3 / cpu);
+
+      if (!r || cpu < best_cpu)
+        {
+          best_cpu = cpu;
+          best_wall = wall;
+        }
+
+      if (r == runs - 1)
+        {
+          if (dec.resyncs || dec.bad_frames)
+            printf("%u resync(s), %u bad frame(s)\n", dec.resyncs, dec.bad_frames);
+
+          printf("%lld frames (%.2f s), checksum %08x\n", (long long)frames,
+                 seconds, sum);
+          printf("best: %.2f ms wall, %.1f ns/frame, %.1f MB/s S32 output, "
+                 "%.2f%% of one core for real time\n",
+                 best_wall, best_cpu * 1e6 / frames,
+                 frames * dec.info.channels * 4.0 / (best_cpu * 1e3),
+                 best_cpu / (seconds * 10.0));
+        }
+
+      flac_close(&dec);
+    }
+
+  if (out)
+    fclose(out);
+  fclose(fp);
+
+  return err ? 1 : 0;
+}
@@ -0,0 +1,525 @@
+
+#include "group.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+
+#include "kaudio/kaudio.h"
+#include "trace_marker.h"
+
+// drain gives up when the FIFOs stop emptying for this long
+#define DRAIN_STALL_US 1000000
+#define DRAIN_POLL_US  2000
+// silence written per chunk to make up for frames lost to an overrun
+#define PAD_CHUNK_BYTES 2048
+
+int audio_group_add(struct audio_group* group, char* spec)
+{
+  struct audio_zone* zone;
+  char* sep;
+
+  if (group->count == MAX_ZONES)
+    {
+      return -ENOSPC;
+    }
+
+  zone = &group->zones[group->count];
+  memset(zone, 0, sizeof(*zone));
+  zone->fd = -1;
+  zone->i2s_fd = -1;
+  zone->device = spec;
+  zone->i2s_path = DEFAULT_ZONE_I2S;
+
+  sep = strchr(spec, ',');
+  if (sep)
+    {
+      *sep = '\0';
+      zone->i2s_path = sep + 1;
+    }
+  else if (group->count)
+    {
+      // the default is zone 0's I2S core, another zone would never start
+      return -EINVAL;
+    }
+
+  group->count++;
+
+  return 0;
+}
+
+/* @brief Read the TX position of one zone
+   @return 0 on success, < 0 on error */
+static int zone_position(struct audio_zone* zone, struct zedaudio_position* pos)
+{
+  if (ioctl(zone->fd, ZEDAUDIO_IOC_GET_POSITION, pos))
+    {
+      return -errno;
+    }
+
+  return 0;
+}
+
+// words that left the FIFO, the driver counts words_written from open
+static uint64_t zone_played(const struct audio_zone* zone,
+                            const struct zedaudio_position* pos)
+{
+  return pos->words_written - (zone->empty_vacancy - pos->tx_vacancy);
+}
+
+int audio_group_open(struct audio_group* group)
+{
+  struct audio_zone* zone;
+  struct zedaudio_position pos;
+  unsigned int i;
+  int err;
+
+  group->started = 0;
+  group->raw = 0;
+  group->bytes_written = 0;
+  // the driver starts out with 32-bit stereo input
+  group->frame_bytes = 2 * sizeof(uint32_t);
+  group->xrun_rate = 0;
+  group->xruns = 0;
+
+  for (i = 0; i < group->count; i++)
+    {
+      zone = &group->zones[i];
+
+      // non-blocking until started, a full FIFO ends the prefill
+      zone->fd = open(zone->device, O_WRONLY | O_NONBLOCK);
+      if (zone->fd < 0)
+        {
+          printf("Failed to open %s: %s\n", zone->device, strerror(errno));
+          return -errno;
+        }
+
+      // the driver resets the TX FIFO on open
+      err = zone_position(zone, &pos);
+      if (err)
+        {
+          return err;
+        }
+      zone->empty_vacancy = pos.tx_vacancy;
+
+      // opened up front so the start trigger is one write per zone
+      zone->i2s_fd = open(zone->i2s_path, O_WRONLY);
+      if (zone->i2s_fd < 0)
+        {
+          printf("Failed to open %s: %s\n", zone->i2s_path, strerror(errno));
+          return -errno;
+        }
+
+      // hold TX while prefilling
+      if (pwrite(zone->i2s_fd, "0", 1, 0) != 1)
+        {
+          return -errno;
+        }
+    }
+
+  return 0;
+}
+
+int audio_group_set_format(struct audio_group* group, unsigned int format,
+                           unsigned int channels)
+{
+  struct zedaudio_format fmt = {
+    .format = format,
+    .channels = channels,
+  };
+  unsigned int i;
+
+  for (i = 0; i < group->count; i++)
+    {
+      if (ioctl(group->zones[i].fd, ZEDAUDIO_IOC_SET_FORMAT, &fmt))
+        {
+          return -errno;
+        }
+    }
+
+  switch (format)
+    {
+    case ZEDAUDIO_FORMAT_S16_LE:
+      group->frame_bytes = 2 * channels;
+      break;
+    case ZEDAUDIO_FORMAT_S24_3LE:
+      group->frame_bytes = 3 * channels;
+      break;
+    default:
+      group->frame_bytes = 4 * channels;
+      break;
+    }
+
+  return 0;
+}
+
+int audio_group_set_xrun(struct audio_group* group, unsigned int policy,
+                         unsigned int rate)
+{
+  struct zedaudio_xrun_config cfg = {
+    .policy = policy,
+    .rate = rate,
+    .period_frames = 0,
+  };
+  unsigned int i;
+
+  for (i = 0; i < group->count; i++)
+    {
+      if (ioctl(group->zones[i].fd, ZEDAUDIO_IOC_SET_XRUN, &cfg))
+        {
+          return -errno;
+        }
+    }
+
+  group->xrun_policy = policy;
+  group->xrun_rate = rate;
+
+  return 0;
+}
+
+/* @brief Collect a reported xrun and work out how far the zone fell behind
+   @return 0 on success, < 0 on error */
+static int zone_xrun(struct audio_group* group, unsigned int z)
+{
+  struct audio_zone* zone = &group->zones[z];
+  struct zedaudio_xrun xrun;
+  struct timespec now;
+  uint64_t behind, lost;
+  int64_t starved_ns;
+
+  if (ioctl(zone->fd, ZEDAUDIO_IOC_GET_XRUN, &xrun))
+    {
+      return -errno;
+    }
+
+  if (!xrun.count)
+    {
+      return 0;
+    }
+
+  // concealed frames took the place of stream frames
+  behind = xrun.concealed_frames - zone->concealed_frames;
+  zone->concealed_frames = xrun.concealed_frames;
+
+  // a stopped zone was silent from the xrun until now
+  if (group->xrun_policy == ZEDAUDIO_XRUN_STOP &&
+      xrun.type == ZEDAUDIO_XRUN_UNDERRUN)
+    {
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      starved_ns = (int64_t)now.tv_sec * 1000000000LL + now.tv_nsec -
+        (int64_t)xrun.timestamp_ns;
+      if (starved_ns > 0)
+        {
+          behind += (uint64_t)starved_ns * group->xrun_rate / 1000000000ULL;
+        }
+    }
+
+  // an overrun reset threw away queued frames that never played
+  lost = xrun.lost_frames - zone->lost_frames;
+  zone->lost_frames = xrun.lost_frames;
+
+  printf("zone %u (%s): %u %s, last at frame %llu, skipping %llu frames, padding %llu\n",
+         z, zone->device, xrun.count,
+         xrun.type == ZEDAUDIO_XRUN_OVERRUN ? "overrun(s)" : "underrun(s)",
+         (unsigned long long)xrun.frame, (unsigned long long)behind,
+         (unsigned long long)lost);
+  trace_marker("xrun zone=%u frame=%llu skip=%llu pad=%llu", z,
+               (unsigned long long)xrun.frame, (unsigned long long)behind,
+               (unsigned long long)lost);
+
+  zone->skip_frames += behind;
+  zone->pad_frames += lost;
+  group->xruns += xrun.count;
+
+  return 0;
+}
+
+int audio_group_start(struct audio_group* group)
+{
+  struct zedaudio_position pos;
+  unsigned int i;
+  int err = 0;
+
+  if (group->started)
+    {
+      return 0;
+    }
+
+  // nothing but the trigger writes in this loop to keep zones together
+  for (i = 0; i < group->count; i++)
+    {
+      if (pwrite(group->zones[i].i2s_fd, "1", 1, 0) != 1)
+        {
+          err = -errno;
+        }
+    }
+
+  group->started = 1;
+  trace_marker("tx start zones=%u", group->count);
+
+  // first skew sample, before anything else can disturb the zones
+  for (i = 0; i < group->count; i++)
+    {
+      if (!zone_position(&group->zones[i], &pos))
+        {
+          group->zones[i].start_played = zone_played(&group->zones[i], &pos);
+          group->zones[i].start_ns = pos.timestamp_ns;
+        }
+    }
+
+  // from now on writers block on a full FIFO
+  for (i = 0; i < group->count; i++)
+    {
+      fcntl(group->zones[i].fd, F_SETFL, 0);
+    }
+
+  return err;
+}
+
+int audio_group_write(struct audio_group* group, unsigned int zone,
+                      const void* buf, size_t bytes)
+{
+  struct audio_zone* z = &group->zones[zone];
+  static const uint8_t silence[PAD_CHUNK_BYTES];
+  struct pollfd pfd = { .fd = z->fd, .events = POLLPRI };
+  const uint8_t* p = buf;
+  size_t skip, pad;
+  ssize_t ret;
+  int err;
+
+  // the driver flags underruns it concealed without failing a write
+  if (group->xrun_rate && poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLPRI))
+    {
+      err = zone_xrun(group, zone);
+      if (err)
+        {
+          return err;
+        }
+    }
+
+  // the zone jumped ahead by what an overrun dropped, hold it back,
+  // pending skips eat into the silence first
+  while (z->pad_frames)
+    {
+      pad = PAD_CHUNK_BYTES / group->frame_bytes;
+      if (pad > z->pad_frames)
+        pad = z->pad_frames;
+
+      z->pad_frames -= pad;
+      err = audio_group_write(group, zone, silence, pad * group->frame_bytes);
+      if (err)
+        {
+          return err;
+        }
+    }
+
+  // catch up with the stream by dropping what was replaced
+  if (z->skip_frames)
+    {
+      skip = bytes / group->frame_bytes;
+      if (skip > z->skip_frames)
+        skip = z->skip_frames;
+
+      z->skip_frames -= skip;
+      p += skip * group->frame_bytes;
+      bytes -= skip * group->frame_bytes;
+    }
+
+  while (bytes)
+    {
+      ret = write(z->fd, p, bytes);
+      if (ret < 0)
+        {
+          // ZEDAUDIO_XRUN_STOP starved TX, resume where it should be now
+          if (errno == EPIPE)
+            {
+              err = zone_xrun(group, zone);
+              if (err)
+                {
+                  return err;
+                }
+              return audio_group_write(group, zone, p, bytes);
+            }
+
+          if (errno != EAGAIN || group->started)
+            {
+              return -errno;
+            }
+
+          // first full FIFO: every zone holds the stream start, go
+          err = audio_group_start(group);
+          if (err)
+            {
+              return err;
+            }
+          continue;
+        }
+
+      p += ret;
+      bytes -= ret;
+      group->bytes_written += ret;
+    }
+
+  return 0;
+}
+
+/* @brief Print each zone's skew against the first zone
+   @param played words out of each zone's FIFO
+   @param ns CLOCK_MONOTONIC of each sample
+   @return worst skew in frames */
+static double print_skew(struct audio_group* group, const uint64_t* played,
+                         const uint64_t* ns, unsigned int sample_rate)
+{
+  double frames, skew, worst = 0.0;
+  unsigned int i;
+
+  for (i = 0; i < group->count; i++)
+    {
+      // project onto the first zone's timestamp
+      frames = (double)played[i] / 2.0 -
+        (double)(int64_t)(ns[i] - ns[0]) * sample_rate / 1e9;
+
+      skew = frames - (double)played[0] / 2.0;
+      printf("\tzone %u (%s): skew %+.2f frames (%+.1f us)\n", i,
+             group->zones[i].device, skew, skew * 1e6 / sample_rate);
+
+      if (skew < 0)
+        skew = -skew;
+      if (skew > worst)
+        worst = skew;
+    }
+
+  return worst;
+}
+
+double audio_group_skew(struct audio_group* group, unsigned int sample_rate)
+{
+  struct zedaudio_position pos[MAX_ZONES];
+  uint64_t played[MAX_ZONES];
+  uint64_t ns[MAX_ZONES];
+  double worst, now;
+  unsigned int i;
+  int err;
+
+  // sample all zones as close together as possible, compare afterwards
+  for (i = 0; i < group->count; i++)
+    {
+      err = zone_position(&group->zones[i], &pos[i]);
+      if (err)
+        {
+          return err;
+        }
+    }
+
+  for (i = 0; i < group->count; i++)
+    {
+      played[i] = group->zones[i].start_played;
+      ns[i] = group->zones[i].start_ns;
+    }
+
+  printf("\tafter TX start:\n");
+  worst = print_skew(group, played, ns, sample_rate);
+
+  for (i = 0; i < group->count; i++)
+    {
+      played[i] = zone_played(&group->zones[i], &pos[i]);
+      ns[i] = pos[i].timestamp_ns;
+    }
+
+  printf("\tnow:\n");
+  now = print_skew(group, played, ns, sample_rate);
+
+  return now > worst ? now : worst;
+}
+
+int audio_group_drain(struct audio_group* group)
+{
+  struct zedaudio_position pos;
+  uint32_t last_vacancy[MAX_ZONES] = { 0 };
+  unsigned int i, busy, progress;
+  unsigned int stalled = 0;
+  int err;
+
+  // short streams may never have filled a FIFO
+  err = audio_group_start(group);
+  if (err)
+    {
+      return err;
+    }
+
+  // running dry at the end of the stream is not an underrun
+  if (group->xrun_rate)
+    {
+      err = audio_group_set_xrun(group, group->xrun_policy, 0);
+      if (err)
+        {
+          return err;
+        }
+    }
+
+  do
+    {
+      busy = 0;
+      progress = 0;
+      for (i = 0; i < group->count; i++)
+        {
+          err = zone_position(&group->zones[i], &pos);
+          if (err)
+            {
+              return err;
+            }
+
+          if (pos.tx_vacancy < group->zones[i].empty_vacancy)
+            {
+              busy = 1;
+            }
+          if (pos.tx_vacancy != last_vacancy[i])
+            {
+              progress = 1;
+            }
+          last_vacancy[i] = pos.tx_vacancy;
+        }
+
+      stalled = progress ? 0 : stalled + DRAIN_POLL_US;
+
+      if (busy)
+        {
+          usleep(DRAIN_POLL_US);
+        }
+    }
+  while (busy && stalled < DRAIN_STALL_US);
+
+  return 0;
+}
+
+void audio_group_close(struct audio_group* group)
+{
+  struct audio_zone* zone;
+  unsigned int i;
+
+  for (i = 0; i < group->count; i++)
+    {
+      zone = &group->zones[i];
+
+      if (zone->i2s_fd >= 0)
+        {
+          pwrite(zone->i2s_fd, "0", 1, 0);
+          close(zone->i2s_fd);
+          zone->i2s_fd = -1;
+        }
+
+      if (zone->fd >= 0)
+        {
+          close(zone->fd);
+          zone->fd = -1;
+        }
+    }
+
+  group->started = 0;
+}
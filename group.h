@@ -0,0 +1,113 @@
+#ifndef GROUP_H
+#define GROUP_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "dsp.h"
+
+// maximum number of FIFO instances driven together
+#define MAX_ZONES 4
+
+#define DEFAULT_ZONE_DEVICE "/dev/zedaudio0"
+#define DEFAULT_ZONE_I2S    "/sys/devices/soc0/amba_pl/77600000.axi_i2s_adi/tx_enabled"
+
+// one zedaudio instance and the I2S core it feeds
+struct audio_zone
+{
+  const char* device;   // character device, e.g. /dev/zedaudio0
+  const char* i2s_path; // tx_enabled attribute of the I2S core
+  int fd;
+  int i2s_fd;
+  uint32_t empty_vacancy; // TX vacancy reported by the empty FIFO
+  // words out of the FIFO just after TX start and when that was sampled
+  uint64_t start_played;
+  uint64_t start_ns;
+  struct dsp_chain chain;
+  // driver xrun totals already accounted for
+  uint64_t concealed_frames;
+  uint64_t lost_frames;
+  // stream frames still to be dropped to catch up after an underrun
+  uint64_t skip_frames;
+  // silent frames still to be written to fall back in step after an overrun
+  uint64_t pad_frames;
+};
+
+// instances started on the same sample
+struct audio_group
+{
+  struct audio_zone zones[MAX_ZONES];
+  unsigned int count;
+  int started;
+  // driver expands samples, file data is written unchanged
+  int raw;
+  // bytes handed to the drivers over all zones
+  uint64_t bytes_written;
+  // bytes per frame of the data written, follows audio_group_set_format
+  unsigned int frame_bytes;
+  // underrun handling, rate 0 while disabled
+  unsigned int xrun_policy;
+  unsigned int xrun_rate;
+  unsigned int xruns;
+};
+
+/* @brief Add a zone to the group
+   @param group the group
+   @param spec DEVICE[,I2S_TX_ENABLED_PATH], the I2S path may only be
+   left out for the first zone
+   @return 0 on success, -ENOSPC if the group is full, -EINVAL if the
+   I2S path is missing */
+int audio_group_add(struct audio_group* group, char* spec);
+
+/* @brief Open all zones for prefilling, TX stays disabled
+   @return 0 on success, < 0 on error */
+int audio_group_open(struct audio_group* group);
+
+/* @brief Let the drivers expand packed samples
+   @param group an opened group
+   @param format ZEDAUDIO_FORMAT_* of the data that will be written
+   @param channels 1 or 2
+   @return 0 if every zone accepted the format, < 0 otherwise */
+int audio_group_set_format(struct audio_group* group, unsigned int format,
+                           unsigned int channels);
+
+/* @brief Let the drivers handle underruns and report them
+   @param group an opened group
+   @param policy ZEDAUDIO_XRUN_*
+   @param rate stream sample rate in Hz, 0 disables underrun handling
+   @return 0 if every zone accepted the policy, < 0 otherwise */
+int audio_group_set_xrun(struct audio_group* group, unsigned int policy,
+                         unsigned int rate);
+
+/* @brief Write a block to one zone. Before the group is started the
+   FIFOs are prefilled, the first full FIFO starts the whole group.
+   After an underrun the zone drops as many frames as played out of the
+   driver, after an overrun it writes silence for the frames the driver
+   threw away, so it stays in step with the other zones.
+   @param group the group
+   @param zone zone index
+   @param buf 32-bit audio words
+   @param bytes number of bytes
+   @return 0 on success, < 0 on error */
+int audio_group_write(struct audio_group* group, unsigned int zone,
+                      const void* buf, size_t bytes);
+
+/* @brief Enable TX on all zones back to back
+   @return 0 on success, < 0 on error */
+int audio_group_start(struct audio_group* group);
+
+/* @brief Print skew of each zone against the first, as sampled just
+   after TX start and as measured now
+   @param group a started group
+   @param sample_rate stream sample rate in Hz
+   @return worst skew in frames, < 0 on error */
+double audio_group_skew(struct audio_group* group, unsigned int sample_rate);
+
+/* @brief Wait until all TX FIFOs have played out
+   @return 0 on success, < 0 on error */
+int audio_group_drain(struct audio_group* group);
+
+/* @brief Disable TX and close all zones */
+void audio_group_close(struct audio_group* group);
+
+#endif
@@ -10,26 +10,63 @@
 #include <linux/interrupt.h>
 #include <linux/slab.h>
 #include <linux/mutex.h>
-#include <asm/spinlock.h>
+#include <linux/spinlock.h>
+#include <linux/bitops.h>
 #include <linux/uaccess.h>
 #include <linux/delay.h>
 #include <linux/irqflags.h>
+#include <linux/kfifo.h>
+#include <linux/poll.h>
+#include <linux/ktime.h>
+#include <linux/hrtimer.h>
+#include <linux/math64.h>
+#include <asm/unaligned.h>
+
+#include "kaudio.h"
+
+#define CREATE_TRACE_POINTS
+#include "kaudio_trace.h"
 #include <asm/io.h>
 #include <linux/types.h>
 
 #define DRIVER_NAME "esl-audio"
 #define AUDIO_WRITE_BUF_SIZE 64
+// stereo output frames per chunk pushed into the FIFO
+#define AUDIO_WRITE_FRAMES (AUDIO_WRITE_BUF_SIZE / 2)
+// largest input frame: stereo 32-bit
+#define AUDIO_MAX_FRAME_BYTES 8
+// capture ring size in words, must be a power of 2
+#define AUDIO_RX_RING_SIZE 8192
+// words kept for repeat-last-period concealment, must be a power of 2
+#define AUDIO_XRUN_HIST_WORDS 1024
+// frames pushed per concealment unless userspace asks otherwise
+#define AUDIO_XRUN_PERIOD_FRAMES 256
+// an underrun is handled when no more than this is left in the TX FIFO
+#define AUDIO_XRUN_GUARD_WORDS 64
 
 #define FIFO_INT_ENABLE   0x4
 #define FIFO_TX_RESET     0x8
 #define FIFO_TX_VACANCY   0xC
 #define FIFO_TX_DATA      0x10
 #define FIFO_RX_RESET     0x18
+#define FIFO_RX_OCCUPANCY 0x1C
+#define FIFO_RX_DATA      0x20
+#define FIFO_RX_LENGTH    0x24
 #define FIFO_STREAM_RESET 0x28
 
 #define FIFO_RESET_VAL 		0xA5
 #define FIFO_TXOVERRUN_VAL 	(1 << 28)
 #define FIFO_TXEMPTY_VAL 	(1 << 21)
+#define FIFO_RXERROR_VAL 	(7 << 29) // underrun read, overrun, underrun
+#define FIFO_RXCOMPLETE_VAL 	(1 << 26)
+#define FIFO_RXFULL_VAL 	(1 << 20)
+#define FIFO_RX_INTS 		(FIFO_RXERROR_VAL | FIFO_RXCOMPLETE_VAL | FIFO_RXFULL_VAL)
+
+// instance flags
+#define ESL_AUDIO_TX_BUSY 0
+#define ESL_AUDIO_RX_BUSY 1
+#define ESL_AUDIO_TX_STOPPED 2    // ZEDAUDIO_XRUN_STOP hit, next write fails
+#define ESL_AUDIO_TX_CONCEALING 3 // driver is feeding TX until the writer is back
 
 // our driver
 struct esl_audio_instance
@@ -49,6 +86,52 @@ struct esl_audio_instance
 
   // wait queue
   wait_queue_head_t waitq;
+
+  // serializes writers sharing one open file (e.g. after fork)
+  struct mutex write_lock;
+
+  // protects FIFO register access between write path and IRQ handler
+  spinlock_t lock;
+
+  // ESL_AUDIO_* flags, TX_BUSY/RX_BUSY allow one writer and one reader
+  unsigned long flags;
+
+  // enabled interrupts, changed under lock
+  u32 int_enable;
+
+  // words pushed into the TX FIFO since open, updated under lock
+  u64 words_written;
+
+  // TX vacancy of the empty FIFO, read after each TX reset
+  u32 tx_empty_vacancy;
+
+  // underrun handling, changed under lock
+  struct zedaudio_xrun_config xrun_cfg;
+  struct zedaudio_xrun xrun;
+  // fires when the queued words are about to run out
+  struct hrtimer xrun_timer;
+
+  // last words written, replayed by ZEDAUDIO_XRUN_REPEAT
+  u32 xrun_hist[AUDIO_XRUN_HIST_WORDS];
+  unsigned int xrun_hist_pos;
+  // tx_queued() when the underrun timer was last armed
+  u32 xrun_queued;
+
+  // input layout of written data, changed under write_lock
+  struct zedaudio_format fmt;
+  unsigned int frame_bytes;
+
+  // partial input frame left over from the previous write
+  u8 carry[AUDIO_MAX_FRAME_BYTES];
+  unsigned int carry_len;
+
+  // capture ring, filled by the IRQ handler and drained by read
+  DECLARE_KFIFO(rx_ring, u32, AUDIO_RX_RING_SIZE);
+  wait_queue_head_t rx_waitq;
+  struct mutex read_lock;
+
+  // words lost because the ring was full
+  unsigned long rx_dropped;
 };
 
 // out global data
@@ -58,37 +141,41 @@ struct esl_audio_driver
   struct class* class;
   unsigned int instance_count;
   struct list_head instance_list;
+  // protects instance_list and instance_count (probe/remove)
+  struct mutex list_lock;
 };
 
 // Initialize global data
 static struct esl_audio_driver driver_data = {
   .instance_count = 0,
   .instance_list = LIST_HEAD_INIT(driver_data.instance_list),
+  .list_lock = __MUTEX_INITIALIZER(driver_data.list_lock),
+};
+
+// input layout until userspace asks for another one
+static const struct zedaudio_format default_format = {
+  .format = ZEDAUDIO_FORMAT_S32_LE,
+  .channels = 2,
+};
+
+// underrun handling stays off until userspace gives the sample rate
+static const struct zedaudio_xrun_config default_xrun = {
+  .policy = ZEDAUDIO_XRUN_SILENCE,
+  .rate = 0,
+  .period_frames = AUDIO_XRUN_PERIOD_FRAMES,
 };
 
 /* Utility Functions */
-// find instance from inode using minor number and linked list
+// find instance from inode, the cdev is embedded in the instance
 static struct esl_audio_instance* inode_to_instance(struct inode* i)
 {
-  struct esl_audio_instance *inst_iter;
-  unsigned int minor = iminor(i);
-
-  list_for_each_entry(inst_iter, &driver_data.instance_list, inst_list)
-    {
-      if (MINOR(inst_iter->devno) == minor)
-        {
-          // found our corresponding instance
-          return inst_iter;
-        }
-    }
-
-  // not found
-  return NULL;
+  return container_of(i->i_cdev, struct esl_audio_instance, chr_dev);
 }
 
+// instance resolved once in open
 static struct esl_audio_instance* file_to_instance(struct file* f)
 {
-  return inode_to_instance(f->f_path.dentry->d_inode);
+  return f->private_data;
 }
 
 /* @brief Check if FIFO is full
@@ -99,90 +186,728 @@ static unsigned int fifo_full(struct esl_audio_instance* inst)
   return !(ioread32(inst->regs + FIFO_TX_VACANCY) > AUDIO_WRITE_BUF_SIZE);
 }
 
+/* @brief Words still queued in the TX FIFO
+   @param inst our instance, called with inst->lock held */
+static u32 tx_queued(struct esl_audio_instance* inst)
+{
+  u32 vacancy = ioread32(inst->regs + FIFO_TX_VACANCY);
+
+  return vacancy < inst->tx_empty_vacancy ? inst->tx_empty_vacancy - vacancy : 0;
+}
+
+/* @brief Arm the underrun timer for when the queued words run out
+   @param inst our instance, called with inst->lock held */
+static void xrun_arm(struct esl_audio_instance* inst)
+{
+  u32 queued, wait;
+  u64 ns;
+
+  if (!inst->xrun_cfg.rate || test_bit(ESL_AUDIO_TX_STOPPED, &inst->flags))
+    {
+      return;
+    }
+
+  // an empty FIFO has nothing to run out of, the next write arms the timer
+  queued = tx_queued(inst);
+  inst->xrun_queued = queued;
+  if (!queued)
+    {
+      return;
+    }
+
+  // look again shortly before the queued words are gone
+  wait = queued > AUDIO_XRUN_GUARD_WORDS ? queued - AUDIO_XRUN_GUARD_WORDS
+    : AUDIO_XRUN_GUARD_WORDS / 2;
+
+  // two words per frame
+  ns = div_u64((u64)wait * NSEC_PER_SEC, 2 * inst->xrun_cfg.rate);
+  hrtimer_start(&inst->xrun_timer, ns_to_ktime(ns), HRTIMER_MODE_REL);
+}
+
+/* @brief Note an xrun for userspace
+   @param inst our instance, called with inst->lock held
+   @param type ZEDAUDIO_XRUN_UNDERRUN or ZEDAUDIO_XRUN_OVERRUN
+   @param frame stream position of the discontinuity */
+static void xrun_record(struct esl_audio_instance* inst, u32 type, u64 frame)
+{
+  inst->xrun.frame = frame;
+  inst->xrun.timestamp_ns = ktime_get_ns();
+  inst->xrun.type = type;
+  inst->xrun.count++;
+
+  trace_kaudio_xrun(MINOR(inst->devno), type, frame);
+
+  // pollers see POLLPRI
+  wake_up(&inst->waitq);
+}
+
+/* @brief TX is about to run dry, apply the underrun policy
+   @param inst our instance, called with inst->lock held */
+static void tx_underrun(struct esl_audio_instance* inst)
+{
+  unsigned int count, room, pos, i;
+
+  // one xrun per starvation, however many periods it takes
+  if (!test_and_set_bit(ESL_AUDIO_TX_CONCEALING, &inst->flags))
+    {
+      xrun_record(inst, ZEDAUDIO_XRUN_UNDERRUN, inst->words_written / 2);
+    }
+
+  if (inst->xrun_cfg.policy == ZEDAUDIO_XRUN_STOP)
+    {
+      // the writer finds out on its next write
+      set_bit(ESL_AUDIO_TX_STOPPED, &inst->flags);
+      return;
+    }
+
+  // whole frames, leaving room for the chunk a writer may push right
+  // after its unlocked fifo_full() check
+  room = ioread32(inst->regs + FIFO_TX_VACANCY);
+  room = room > AUDIO_WRITE_BUF_SIZE ? room - AUDIO_WRITE_BUF_SIZE : 0;
+  count = min_t(u32, inst->xrun_cfg.period_frames * 2, room) & ~1U;
+
+  pos = (inst->xrun_hist_pos - count) & (AUDIO_XRUN_HIST_WORDS - 1);
+  for (i = 0; i < count; i++)
+    {
+      if (inst->xrun_cfg.policy == ZEDAUDIO_XRUN_REPEAT)
+        {
+          iowrite32(inst->xrun_hist[pos], inst->regs + FIFO_TX_DATA);
+          pos = (pos + 1) & (AUDIO_XRUN_HIST_WORDS - 1);
+        }
+      else
+        {
+          iowrite32(0, inst->regs + FIFO_TX_DATA);
+        }
+    }
+
+  inst->words_written += count;
+  inst->xrun.concealed_frames += count / 2;
+
+  xrun_arm(inst);
+}
+
+static enum hrtimer_restart xrun_timer_fn(struct hrtimer* timer)
+{
+  struct esl_audio_instance* inst =
+    container_of(timer, struct esl_audio_instance, xrun_timer);
+  unsigned long irqflags;
+  u32 queued;
+
+  spin_lock_irqsave(&inst->lock, irqflags);
+
+  // a write may have moved the deadline while we waited for the lock
+  if (!hrtimer_is_queued(timer) && inst->xrun_cfg.rate &&
+      !test_bit(ESL_AUDIO_TX_STOPPED, &inst->flags))
+    {
+      queued = tx_queued(inst);
+
+      // only a FIFO that drained since the timer was armed is starving,
+      // before TX is enabled nothing leaves it
+      if (queued <= AUDIO_XRUN_GUARD_WORDS && queued < inst->xrun_queued)
+        {
+          tx_underrun(inst);
+        }
+      else
+        {
+          // TX not started yet or running slower than the nominal rate
+          xrun_arm(inst);
+        }
+    }
+
+  spin_unlock_irqrestore(&inst->lock, irqflags);
+
+  return HRTIMER_NORESTART;
+}
+
+/* @brief Push words into the TX FIFO
+   @param inst our instance
+   @param words buffer of 32-bit audio words
+   @param count number of words */
+static void fifo_push_words(struct esl_audio_instance* inst,
+                            const u32* words, unsigned int count)
+{
+  unsigned long irqflags;
+  unsigned int i;
+
+  // keep the IRQ handler from resetting the FIFO in the middle of a chunk
+  spin_lock_irqsave(&inst->lock, irqflags);
+  for (i = 0; i < count; i++)
+    {
+      iowrite32(words[i], inst->regs + FIFO_TX_DATA);
+    }
+  inst->words_written += count;
+
+  // remember what was played for repeat concealment
+  if (inst->xrun_cfg.policy == ZEDAUDIO_XRUN_REPEAT)
+    {
+      for (i = 0; i < count; i++)
+        {
+          inst->xrun_hist[inst->xrun_hist_pos] = words[i];
+          inst->xrun_hist_pos = (inst->xrun_hist_pos + 1) & (AUDIO_XRUN_HIST_WORDS - 1);
+        }
+    }
+
+  // the writer is back, move the underrun deadline out
+  clear_bit(ESL_AUDIO_TX_CONCEALING, &inst->flags);
+  xrun_arm(inst);
+
+  spin_unlock_irqrestore(&inst->lock, irqflags);
+}
+
+/* @brief Expand input frames to left-justified 32-bit stereo words
+   @param fmt input layout
+   @param in packed input frames
+   @param frames number of frames
+   @param out destination, 2 words per frame */
+static void expand_frames(const struct zedaudio_format* fmt, const u8* in,
+                          unsigned int frames, u32* out)
+{
+  unsigned int i, ch;
+  u32 word = 0;
+
+  for (i = 0; i < frames; i++)
+    {
+      for (ch = 0; ch < fmt->channels; ch++)
+        {
+          switch (fmt->format)
+            {
+            case ZEDAUDIO_FORMAT_S16_LE:
+              word = (u32)get_unaligned_le16(in) << 16;
+              in += 2;
+              break;
+            case ZEDAUDIO_FORMAT_S24_3LE:
+              word = ((u32)in[0] << 8) | ((u32)in[1] << 16) | ((u32)in[2] << 24);
+              in += 3;
+              break;
+            default:
+              word = get_unaligned_le32(in);
+              in += 4;
+              break;
+            }
+          out[2 * i + ch] = word;
+        }
+
+      // mono plays on both channels
+      if (fmt->channels == 1)
+        {
+          out[2 * i + 1] = word;
+        }
+    }
+}
+
+/* @brief Set the input layout of written data
+   @return 0 on success, < 0 if the layout is not supported */
+static int set_format(struct esl_audio_instance* inst,
+                      const struct zedaudio_format* fmt)
+{
+  unsigned int sample_bytes;
+
+  switch (fmt->format)
+    {
+    case ZEDAUDIO_FORMAT_S32_LE:
+      sample_bytes = 4;
+      break;
+    case ZEDAUDIO_FORMAT_S16_LE:
+      sample_bytes = 2;
+      break;
+    case ZEDAUDIO_FORMAT_S24_3LE:
+      sample_bytes = 3;
+      break;
+    default:
+      return -EINVAL;
+    }
+
+  if (fmt->channels != 1 && fmt->channels != 2)
+    {
+      return -EINVAL;
+    }
+
+  inst->fmt = *fmt;
+  inst->frame_bytes = sample_bytes * fmt->channels;
+  inst->carry_len = 0;
+
+  return 0;
+}
+
 /* Character device File Ops */
 static ssize_t esl_audio_write(struct file* f,
                                const char __user *buf, size_t len,
                                loff_t* offset)
 {
   struct esl_audio_instance *inst = file_to_instance(f);
-  unsigned int written = 0;
-  unsigned int temp_buf[AUDIO_WRITE_BUF_SIZE]; //32?
-  int i;
-  int bytes_to_copy;
+  size_t written = 0;
+  u32 temp_buf[AUDIO_WRITE_BUF_SIZE];
+  u8 in_buf[AUDIO_WRITE_FRAMES * AUDIO_MAX_FRAME_BYTES];
+  size_t bytes_to_copy;
+  unsigned int have, frames;
+  ssize_t ret;
+  bool sleeping;
+  int err = 0;
 
   //printk(KERN_INFO "Wrote %d bytes to character device\n", len);
 
-  if (!inst)
+  trace_kaudio_write_enter(MINOR(inst->devno), len);
+
+  if (mutex_lock_interruptible(&inst->write_lock))
     {
-      // instance not found
-      return -ENOENT;
+      trace_kaudio_write_exit(MINOR(inst->devno), -ERESTARTSYS);
+      return -ERESTARTSYS;
+    }
+
+  // TX starved under ZEDAUDIO_XRUN_STOP, fail once, the next write resumes
+  if (test_and_clear_bit(ESL_AUDIO_TX_STOPPED, &inst->flags))
+    {
+      inst->carry_len = 0;
+      err = -EPIPE;
     }
 
   // Implement write to AXI FIFO
-  while(written < len)
+  while(!err && written < len)
   {
-	  wait_event_interruptible(inst->waitq, !(fifo_full(inst)));
+	  // Lab 4.4.2) polling in kernel has worse impact than in user space.
+	  // Kernel has a higher priority and will waste system time that could be doing other things.
+	  // removing the sleep grinds the system to a halt until the audio is played. Top shows the process
+	  // using 100% cpu with no sleep and ~16-30% of the cpu with the sleep in place
+	  // Lab 4.4.4) Stress has no impact on low rate stuff like hal audio, but makes higher sample rate
+	  // things skip slightly
+
+	  //while(fifo_full(inst))
+	  //{
+	  //  usleep_range(19, 21);
+	  //}
+	  if ((f->f_flags & O_NONBLOCK) && fifo_full(inst))
+	  {
+		  err = -EAGAIN;
+		  break;
+	  }
 
-	  if(len < AUDIO_WRITE_BUF_SIZE)
+	  // vacancy reads for the trace only happen while it is enabled
+	  sleeping = trace_kaudio_wait_sleep_enabled() && fifo_full(inst);
+	  if (sleeping)
 	  {
-		  bytes_to_copy = len - written;
+		  trace_kaudio_wait_sleep(MINOR(inst->devno),
+		                          ioread32(inst->regs + FIFO_TX_VACANCY));
 	  }
-	  else
+
+	  err = wait_event_interruptible(inst->waitq, !(fifo_full(inst)));
+
+	  if (sleeping)
+	  {
+		  trace_kaudio_wait_wake(MINOR(inst->devno),
+		                         ioread32(inst->regs + FIFO_TX_VACANCY), err);
+	  }
+
+	  if (err)
 	  {
-		  bytes_to_copy = AUDIO_WRITE_BUF_SIZE * sizeof(unsigned int);
+		  break;
 	  }
 
-	  copy_from_user(temp_buf, buf + written, bytes_to_copy);
+	  // complete the frame a previous write left unfinished
+	  have = inst->carry_len;
+	  memcpy(in_buf, inst->carry, have);
 
-  	  for(i = 0; i < bytes_to_copy/(sizeof(unsigned int)); i++)
-  	  {
-  		// Lab 4.4.2) polling in kernel has worse impact than in user space.
-  		// Kernel has a higher priority and will waste system time that could be doing other things.
-  		// removing the sleep grinds the system to a halt until the audio is played. Top shows the process
-  		// using 100% cpu with no sleep and ~16-30% of the cpu with the sleep in place
-  		// Lab 4.4.4) Stress has no impact on low rate stuff like hal audio, but makes higher sample rate
-  		// things skip slightly
+	  bytes_to_copy = min_t(size_t, len - written,
+	                        AUDIO_WRITE_FRAMES * inst->frame_bytes - have);
 
-  	  	//while(fifo_full(inst))
-  	  	//{
-  		//  usleep_range(19, 21);
-  	  	//}
+	  if (copy_from_user(in_buf + have, buf + written, bytes_to_copy))
+	  {
+		  err = -EFAULT;
+		  break;
+	  }
+	  have += bytes_to_copy;
+
+	  // expand while filling, userspace may hand over packed samples
+	  frames = have / inst->frame_bytes;
+	  expand_frames(&inst->fmt, in_buf, frames, temp_buf);
+	  fifo_push_words(inst, temp_buf, frames * 2);
 
-  		iowrite32(temp_buf[i], inst->regs + FIFO_TX_DATA);
-  	  }
+	  inst->carry_len = have - frames * inst->frame_bytes;
+	  memcpy(inst->carry, in_buf + frames * inst->frame_bytes, inst->carry_len);
 
-  	  written += bytes_to_copy;
+	  written += bytes_to_copy;
   }
 
-  return written;
+  mutex_unlock(&inst->write_lock);
+
+  // report partial writes, errors only if nothing went out
+  ret = written ? written : err;
+
+  trace_kaudio_write_exit(MINOR(inst->devno), ret);
+
+  return ret;
 }
 
+static ssize_t esl_audio_read(struct file* f, char __user *buf, size_t len,
+                              loff_t* offset)
+{
+  struct esl_audio_instance *inst = file_to_instance(f);
+  unsigned int copied = 0;
+  int err = 0;
+
+  // ring only hands out whole words
+  len &= ~(sizeof(u32) - 1);
+  if (!len)
+    {
+      return -EINVAL;
+    }
+
+  if (mutex_lock_interruptible(&inst->read_lock))
+    {
+      return -ERESTARTSYS;
+    }
+
+  if (kfifo_is_empty(&inst->rx_ring))
+    {
+      if (f->f_flags & O_NONBLOCK)
+        {
+          err = -EAGAIN;
+          goto out;
+        }
+
+      err = wait_event_interruptible(inst->rx_waitq,
+                                     !kfifo_is_empty(&inst->rx_ring));
+      if (err)
+        {
+          goto out;
+        }
+    }
+
+  // single consumer under read_lock, single producer in the IRQ handler
+  err = kfifo_to_user(&inst->rx_ring, buf, len, &copied);
+
+out:
+  mutex_unlock(&inst->read_lock);
+
+  if (copied)
+    {
+      return copied;
+    }
+
+  return err;
+}
+
+static unsigned int esl_audio_poll(struct file* f, poll_table* wait)
+{
+  struct esl_audio_instance *inst = file_to_instance(f);
+  unsigned int mask = 0;
+
+  poll_wait(f, &inst->waitq, wait);
+  poll_wait(f, &inst->rx_waitq, wait);
+
+  if ((f->f_mode & FMODE_WRITE) && !fifo_full(inst))
+    {
+      mask |= POLLOUT | POLLWRNORM;
+    }
+
+  if ((f->f_mode & FMODE_READ) && !kfifo_is_empty(&inst->rx_ring))
+    {
+      mask |= POLLIN | POLLRDNORM;
+    }
+
+  // unread xrun, fetch it with ZEDAUDIO_IOC_GET_XRUN
+  if ((f->f_mode & FMODE_WRITE) && READ_ONCE(inst->xrun.count))
+    {
+      mask |= POLLPRI;
+    }
+
+  return mask;
+}
+
+static long esl_audio_ioctl(struct file* f, unsigned int cmd,
+                            unsigned long arg)
+{
+  struct esl_audio_instance *inst = file_to_instance(f);
+  struct zedaudio_position pos;
+  struct zedaudio_format fmt;
+  struct zedaudio_xrun_config xcfg;
+  struct zedaudio_xrun xrun;
+  unsigned long irqflags;
+  int err;
+
+  switch (cmd)
+    {
+    case ZEDAUDIO_IOC_GET_POSITION:
+      // sample vacancy and time together so positions of several
+      // instances can be compared
+      spin_lock_irqsave(&inst->lock, irqflags);
+      pos.tx_vacancy = ioread32(inst->regs + FIFO_TX_VACANCY);
+      pos.timestamp_ns = ktime_get_ns();
+      pos.words_written = inst->words_written;
+      spin_unlock_irqrestore(&inst->lock, irqflags);
+      pos.tx_depth = inst->tx_fifo_depth;
+
+      if (copy_to_user((void __user *)arg, &pos, sizeof(pos)))
+        {
+          return -EFAULT;
+        }
+      return 0;
+    case ZEDAUDIO_IOC_SET_FORMAT:
+      if (!(f->f_mode & FMODE_WRITE))
+        {
+          return -EBADF;
+        }
+
+      if (copy_from_user(&fmt, (void __user *)arg, sizeof(fmt)))
+        {
+          return -EFAULT;
+        }
+
+      // not in the middle of a write
+      if (mutex_lock_interruptible(&inst->write_lock))
+        {
+          return -ERESTARTSYS;
+        }
+      err = set_format(inst, &fmt);
+      mutex_unlock(&inst->write_lock);
+
+      return err;
+    case ZEDAUDIO_IOC_SET_XRUN:
+      if (!(f->f_mode & FMODE_WRITE))
+        {
+          return -EBADF;
+        }
+
+      if (copy_from_user(&xcfg, (void __user *)arg, sizeof(xcfg)))
+        {
+          return -EFAULT;
+        }
+
+      if (xcfg.policy > ZEDAUDIO_XRUN_STOP ||
+          xcfg.period_frames > AUDIO_XRUN_HIST_WORDS / 2)
+        {
+          return -EINVAL;
+        }
+
+      if (!xcfg.period_frames)
+        {
+          xcfg.period_frames = AUDIO_XRUN_PERIOD_FRAMES;
+        }
+
+      spin_lock_irqsave(&inst->lock, irqflags);
+      inst->xrun_cfg = xcfg;
+      if (!xcfg.rate)
+        {
+          clear_bit(ESL_AUDIO_TX_STOPPED, &inst->flags);
+        }
+      xrun_arm(inst);
+      spin_unlock_irqrestore(&inst->lock, irqflags);
+
+      // disabled, e.g. before draining, nothing re-arms the timer now
+      if (!xcfg.rate)
+        {
+          hrtimer_cancel(&inst->xrun_timer);
+        }
+
+      return 0;
+    case ZEDAUDIO_IOC_GET_XRUN:
+      spin_lock_irqsave(&inst->lock, irqflags);
+      xrun = inst->xrun;
+      inst->xrun.count = 0;
+      spin_unlock_irqrestore(&inst->lock, irqflags);
+
+      if (copy_to_user((void __user *)arg, &xrun, sizeof(xrun)))
+        {
+          return -EFAULT;
+        }
+      return 0;
+    default:
+      return -ENOTTY;
+    }
+}
+
+/* @brief Drop anything a previous writer left in the TX FIFO, restart
+   the TX position at 0 and go back to 32-bit stereo input without
+   underrun handling */
+static void tx_reset(struct esl_audio_instance* inst)
+{
+  unsigned long irqflags;
+
+  mutex_lock(&inst->write_lock);
+  set_format(inst, &default_format);
+  mutex_unlock(&inst->write_lock);
+
+  spin_lock_irqsave(&inst->lock, irqflags);
+  iowrite32(FIFO_RESET_VAL, inst->regs + FIFO_TX_RESET);
+  inst->tx_empty_vacancy = ioread32(inst->regs + FIFO_TX_VACANCY);
+  inst->words_written = 0;
+  inst->xrun_cfg = default_xrun;
+  inst->xrun_queued = 0;
+  memset(&inst->xrun, 0, sizeof(inst->xrun));
+  clear_bit(ESL_AUDIO_TX_STOPPED, &inst->flags);
+  clear_bit(ESL_AUDIO_TX_CONCEALING, &inst->flags);
+  spin_unlock_irqrestore(&inst->lock, irqflags);
+}
+
+/* @brief Stop underrun handling, the writer is gone */
+static void tx_stop(struct esl_audio_instance* inst)
+{
+  unsigned long irqflags;
+
+  spin_lock_irqsave(&inst->lock, irqflags);
+  inst->xrun_cfg.rate = 0;
+  spin_unlock_irqrestore(&inst->lock, irqflags);
+
+  hrtimer_cancel(&inst->xrun_timer);
+}
+
+/* @brief Start capturing: reset the RX side and enable its interrupts */
+static void rx_start(struct esl_audio_instance* inst)
+{
+  unsigned long irqflags;
+
+  spin_lock_irqsave(&inst->lock, irqflags);
+  iowrite32(FIFO_RESET_VAL, inst->regs + FIFO_RX_RESET);
+  kfifo_reset(&inst->rx_ring);
+  inst->rx_dropped = 0;
+  inst->int_enable |= FIFO_RX_INTS;
+  iowrite32(inst->int_enable, inst->regs + FIFO_INT_ENABLE);
+  spin_unlock_irqrestore(&inst->lock, irqflags);
+}
+
+static void rx_stop(struct esl_audio_instance* inst)
+{
+  unsigned long irqflags;
+
+  spin_lock_irqsave(&inst->lock, irqflags);
+  inst->int_enable &= ~FIFO_RX_INTS;
+  iowrite32(inst->int_enable, inst->regs + FIFO_INT_ENABLE);
+  spin_unlock_irqrestore(&inst->lock, irqflags);
+
+  if (inst->rx_dropped)
+    {
+      printk(KERN_INFO "%s: dropped %lu captured words\n", DRIVER_NAME,
+             inst->rx_dropped);
+    }
+}
+
+/* @brief Open: resolve instance once, allow one writer and one reader
+   per instance, together they make a full-duplex stream */
 static int device_open(struct inode *inode, struct file *file)
 {
-	printk(KERN_INFO "Hello from open\n");
+	struct esl_audio_instance* inst = inode_to_instance(inode);
+
+	if (file->f_mode & FMODE_WRITE)
+	{
+		// another process already streams to this FIFO
+		if (test_and_set_bit(ESL_AUDIO_TX_BUSY, &inst->flags))
+		{
+			return -EBUSY;
+		}
+
+		// new stream starts from an empty FIFO so it can be prefilled
+		tx_reset(inst);
+	}
+
+	if (file->f_mode & FMODE_READ)
+	{
+		if (test_and_set_bit(ESL_AUDIO_RX_BUSY, &inst->flags))
+		{
+			if (file->f_mode & FMODE_WRITE)
+			{
+				clear_bit(ESL_AUDIO_TX_BUSY, &inst->flags);
+			}
+			return -EBUSY;
+		}
+
+		rx_start(inst);
+	}
+
+	file->private_data = inst;
+
+	return 0;
+}
+
+static int device_release(struct inode *inode, struct file *file)
+{
+	struct esl_audio_instance* inst = file_to_instance(file);
+
+	if (file->f_mode & FMODE_WRITE)
+	{
+		tx_stop(inst);
+		clear_bit(ESL_AUDIO_TX_BUSY, &inst->flags);
+	}
+
+	if (file->f_mode & FMODE_READ)
+	{
+		rx_stop(inst);
+		clear_bit(ESL_AUDIO_RX_BUSY, &inst->flags);
+	}
 
 	return 0;
 }
 
 struct file_operations esl_audio_fops = {
+  .owner = THIS_MODULE,
   .write = esl_audio_write,
+  .read = esl_audio_read,
+  .poll = esl_audio_poll,
+  .unlocked_ioctl = esl_audio_ioctl,
   .open = device_open,
+  .release = device_release,
 };
 
+/* @brief Move captured words from the RX FIFO into the ring
+   @param inst our instance, called with inst->lock held */
+static void rx_drain(struct esl_audio_instance* inst)
+{
+  u32 words;
+  u32 word;
+
+  // one packet at a time: RLR first, then exactly its words (PG080),
+  // reading past the packet raises RPURE and resets the RX FIFO
+  while (ioread32(inst->regs + FIFO_RX_OCCUPANCY))
+    {
+      words = DIV_ROUND_UP(ioread32(inst->regs + FIFO_RX_LENGTH), sizeof(u32));
+      if (!words)
+        {
+          break;
+        }
+
+      while (words--)
+        {
+          word = ioread32(inst->regs + FIFO_RX_DATA);
+          if (!kfifo_put(&inst->rx_ring, word))
+            {
+              inst->rx_dropped++;
+            }
+        }
+    }
+
+  wake_up_interruptible(&inst->rx_waitq);
+}
+
 /* interrupt handler */
 static irqreturn_t esl_audio_irq_handler(int irq, void* dev_id)
 {
   struct esl_audio_instance* inst = dev_id;
-  int intval;
+  u32 intval;
+  u32 queued;
+
+  spin_lock(&inst->lock);
 
   // read interrupt status regsiter
   intval = ioread32(inst->regs);
 
+  // the extra register read is only paid while tracing
+  if (trace_kaudio_irq_enabled())
+  {
+	  trace_kaudio_irq(MINOR(inst->devno), intval,
+	                   ioread32(inst->regs + FIFO_TX_VACANCY));
+  }
+
   // handle tx overrun
   if(intval & FIFO_TXOVERRUN_VAL)
   {
+	  // everything still queued is lost with the reset
+	  queued = tx_queued(inst);
+
 	  // reset tx fifo
 	  iowrite32(FIFO_RESET_VAL, inst->regs + FIFO_TX_RESET);
+	  trace_kaudio_tx_overrun_reset(MINOR(inst->devno), inst->words_written);
+
+	  inst->xrun.lost_frames += queued / 2;
+	  xrun_record(inst, ZEDAUDIO_XRUN_OVERRUN,
+	              (inst->words_written - queued) / 2);
 
 	  // clear tx overrun interrupt in interrupt status register
 	  iowrite32(FIFO_TXOVERRUN_VAL, inst->regs);
@@ -202,10 +927,24 @@ static irqreturn_t esl_audio_irq_handler(int irq, void* dev_id)
 	 intval &= ~FIFO_TXEMPTY_VAL;
   }
 
+  if(intval & FIFO_RXERROR_VAL)
+  {
+	  // lost sync with the receive side, start over
+	  iowrite32(FIFO_RESET_VAL, inst->regs + FIFO_RX_RESET);
+	  intval &= ~FIFO_RXERROR_VAL;
+  }
+  else if(intval & (FIFO_RXCOMPLETE_VAL | FIFO_RXFULL_VAL))
+  {
+	  rx_drain(inst);
+	  intval &= ~(FIFO_RXCOMPLETE_VAL | FIFO_RXFULL_VAL);
+  }
+
   //printk("Hello from IRQ %08x\n", intval);
 
   iowrite32(0xFFFFFFFF, inst->regs);
 
+  spin_unlock(&inst->lock);
+
   return IRQ_HANDLED;
 }
 
@@ -221,6 +960,23 @@ static int esl_audio_probe(struct platform_device* pdev)
   // allocate instance
   inst = devm_kzalloc(&pdev->dev, sizeof(struct esl_audio_instance),
                       GFP_KERNEL);
+  if (!inst)
+    {
+      return -ENOMEM;
+    }
+
+  // init wait queue and locks before the IRQ or the device node can use them
+  init_waitqueue_head(&inst->waitq);
+  init_waitqueue_head(&inst->rx_waitq);
+  mutex_init(&inst->write_lock);
+  mutex_init(&inst->read_lock);
+  INIT_KFIFO(inst->rx_ring);
+  set_format(inst, &default_format);
+  inst->xrun_cfg = default_xrun;
+  hrtimer_init(&inst->xrun_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+  inst->xrun_timer.function = xrun_timer_fn;
+  spin_lock_init(&inst->lock);
+  INIT_LIST_HEAD(&inst->inst_list);
 
   // set platform driver data
   platform_set_drvdata(pdev, inst);
@@ -267,6 +1023,16 @@ static int esl_audio_probe(struct platform_device* pdev)
   // save irq number
   inst->irqnum = res->start;
 
+  // reset AXI FIFO
+  // reset value for these registers is 0xA5 from datasheet
+  iowrite32(FIFO_RESET_VAL, inst->regs + FIFO_STREAM_RESET);
+  iowrite32(FIFO_RESET_VAL, inst->regs + FIFO_TX_RESET);
+  iowrite32(FIFO_RESET_VAL, inst->regs + FIFO_RX_RESET);
+  inst->tx_empty_vacancy = ioread32(inst->regs + FIFO_TX_VACANCY);
+
+  // instance count and list are shared with concurrent probe/remove
+  mutex_lock(&driver_data.list_lock);
+
   // create character device
   // get device number
   inst->devno = MKDEV(MAJOR(driver_data.first_devno),
@@ -277,6 +1043,7 @@ static int esl_audio_probe(struct platform_device* pdev)
   // the file operations in the struct file_operations named echo_fops
   // This sets the read and write functions to echo_read and echo_write
   cdev_init(&(inst->chr_dev), &esl_audio_fops);
+  inst->chr_dev.owner = THIS_MODULE;
 
   // Add our character device echo_dev to the system given the device number
   // we allocated above with alloc_chrdev_region. Ensure that there is only 1
@@ -284,6 +1051,7 @@ static int esl_audio_probe(struct platform_device* pdev)
   err = cdev_add(&(inst->chr_dev), inst->devno, 1);
   if (err)
   {
+	  mutex_unlock(&driver_data.list_lock);
 	  return err;
   }
 
@@ -296,8 +1064,8 @@ static int esl_audio_probe(struct platform_device* pdev)
 					  "zedaudio%d", driver_data.instance_count);
   if(IS_ERR(dev))
   {
-	  device_destroy(driver_data.class, inst->devno);
 	  cdev_del(&(inst->chr_dev));
+	  mutex_unlock(&driver_data.list_lock);
 	  return PTR_ERR(dev);
   }
 
@@ -307,20 +1075,13 @@ static int esl_audio_probe(struct platform_device* pdev)
   driver_data.instance_count++;
 
   // put into list
-  INIT_LIST_HEAD(&inst->inst_list);
   list_add(&inst->inst_list, &driver_data.instance_list);
 
-  // init wait queue
-  init_waitqueue_head(&inst->waitq);
+  mutex_unlock(&driver_data.list_lock);
 
-  // reset AXI FIFO
-  // reset value for these registers is 0xA5 from datasheet
-  iowrite32(FIFO_RESET_VAL, inst->regs + FIFO_STREAM_RESET);
-  iowrite32(FIFO_RESET_VAL, inst->regs + FIFO_TX_RESET);
-  iowrite32(FIFO_RESET_VAL, inst->regs + FIFO_RX_RESET);
-
-  // enable interrupts
-  iowrite32(FIFO_TXOVERRUN_VAL | FIFO_TXEMPTY_VAL, inst->regs + FIFO_INT_ENABLE);
+  // enable interrupts, RX ones are enabled when a reader opens
+  inst->int_enable = FIFO_TXOVERRUN_VAL | FIFO_TXEMPTY_VAL;
+  iowrite32(inst->int_enable, inst->regs + FIFO_INT_ENABLE);
 
   return 0;
 }
@@ -329,12 +1090,16 @@ static int esl_audio_remove(struct platform_device* pdev)
 {
   struct esl_audio_instance* inst = platform_get_drvdata(pdev);
 
+  hrtimer_cancel(&inst->xrun_timer);
+
   // TODO remove all traces of character device
   device_destroy(driver_data.class, inst->devno);
   cdev_del(&(inst->chr_dev));
 
   // remove from list
+  mutex_lock(&driver_data.list_lock);
   list_del(&inst->inst_list);
+  mutex_unlock(&driver_data.list_lock);
 
   return 0;
 }
@@ -0,0 +1,66 @@
+/* zedaudio character device interface, shared by kaudio and userspace */
+
+#ifndef KAUDIO_H
+#define KAUDIO_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define ZEDAUDIO_IOC_MAGIC 'z'
+
+// TX position snapshot, vacancy and timestamp are sampled together
+struct zedaudio_position
+{
+  __u64 words_written; // words pushed into the TX FIFO since open
+  __u64 timestamp_ns;  // CLOCK_MONOTONIC when vacancy was read
+  __u32 tx_vacancy;    // free words in the TX FIFO
+  __u32 tx_depth;      // TX FIFO depth in words
+};
+
+// sample formats accepted by write(), expanded to left-justified 32-bit words
+#define ZEDAUDIO_FORMAT_S32_LE  0 // 32-bit words, the default
+#define ZEDAUDIO_FORMAT_S16_LE  1
+#define ZEDAUDIO_FORMAT_S24_3LE 2 // packed, 3 bytes per sample
+
+// input stream layout, mono is duplicated to both FIFO channels
+struct zedaudio_format
+{
+  __u32 format;   // ZEDAUDIO_FORMAT_*
+  __u32 channels; // 1 or 2
+};
+
+// what the driver does when the writer falls behind and TX runs dry
+#define ZEDAUDIO_XRUN_SILENCE 0 // push a period of zeros
+#define ZEDAUDIO_XRUN_REPEAT  1 // push the last written period again
+#define ZEDAUDIO_XRUN_STOP    2 // let TX starve, the next write fails with EPIPE
+
+// underrun handling, the driver default is rate 0 (disabled). Watching
+// starts with the first write, an empty FIFO that never played is no underrun
+struct zedaudio_xrun_config
+{
+  __u32 policy;        // ZEDAUDIO_XRUN_*
+  __u32 rate;          // stream sample rate in Hz, 0 disables underrun handling
+  __u32 period_frames; // frames pushed per concealment, 0 for the default
+};
+
+#define ZEDAUDIO_XRUN_UNDERRUN 1
+#define ZEDAUDIO_XRUN_OVERRUN  2
+
+// xrun state, frames count like words_written / 2 of zedaudio_position
+struct zedaudio_xrun
+{
+  __u64 frame;            // stream position of the last xrun
+  __u64 timestamp_ns;     // CLOCK_MONOTONIC of the last xrun
+  __u64 concealed_frames; // frames pushed by the driver since open
+  __u64 lost_frames;      // queued frames discarded by overrun resets since open
+  __u32 count;            // xruns since the last ZEDAUDIO_IOC_GET_XRUN
+  __u32 type;             // ZEDAUDIO_XRUN_UNDERRUN or _OVERRUN, last xrun
+};
+
+#define ZEDAUDIO_IOC_GET_POSITION _IOR(ZEDAUDIO_IOC_MAGIC, 0, struct zedaudio_position)
+#define ZEDAUDIO_IOC_SET_FORMAT   _IOW(ZEDAUDIO_IOC_MAGIC, 1, struct zedaudio_format)
+#define ZEDAUDIO_IOC_SET_XRUN     _IOW(ZEDAUDIO_IOC_MAGIC, 2, struct zedaudio_xrun_config)
+// reads and clears count, poll() reports POLLPRI while count is non-zero
+#define ZEDAUDIO_IOC_GET_XRUN     _IOR(ZEDAUDIO_IOC_MAGIC, 3, struct zedaudio_xrun)
+
+#endif
@@ -0,0 +1,129 @@
+/* kaudio tracepoints, enable with
+   echo 1 > /sys/kernel/tracing/events/kaudio/enable */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM kaudio
+
+#if !defined(_KAUDIO_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _KAUDIO_TRACE_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(kaudio_write_enter,
+  TP_PROTO(unsigned int minor, size_t len),
+  TP_ARGS(minor, len),
+  TP_STRUCT__entry(
+    __field(unsigned int, minor)
+    __field(size_t, len)
+  ),
+  TP_fast_assign(
+    __entry->minor = minor;
+    __entry->len = len;
+  ),
+  TP_printk("minor=%u len=%zu", __entry->minor, __entry->len)
+);
+
+TRACE_EVENT(kaudio_write_exit,
+  TP_PROTO(unsigned int minor, ssize_t ret),
+  TP_ARGS(minor, ret),
+  TP_STRUCT__entry(
+    __field(unsigned int, minor)
+    __field(ssize_t, ret)
+  ),
+  TP_fast_assign(
+    __entry->minor = minor;
+    __entry->ret = ret;
+  ),
+  TP_printk("minor=%u ret=%zd", __entry->minor, __entry->ret)
+);
+
+// writer found the FIFO full and sleeps on the wait queue
+TRACE_EVENT(kaudio_wait_sleep,
+  TP_PROTO(unsigned int minor, u32 vacancy),
+  TP_ARGS(minor, vacancy),
+  TP_STRUCT__entry(
+    __field(unsigned int, minor)
+    __field(u32, vacancy)
+  ),
+  TP_fast_assign(
+    __entry->minor = minor;
+    __entry->vacancy = vacancy;
+  ),
+  TP_printk("minor=%u vacancy=%u", __entry->minor, __entry->vacancy)
+);
+
+TRACE_EVENT(kaudio_wait_wake,
+  TP_PROTO(unsigned int minor, u32 vacancy, int err),
+  TP_ARGS(minor, vacancy, err),
+  TP_STRUCT__entry(
+    __field(unsigned int, minor)
+    __field(u32, vacancy)
+    __field(int, err)
+  ),
+  TP_fast_assign(
+    __entry->minor = minor;
+    __entry->vacancy = vacancy;
+    __entry->err = err;
+  ),
+  TP_printk("minor=%u vacancy=%u err=%d", __entry->minor, __entry->vacancy,
+            __entry->err)
+);
+
+// interrupt status as read on entry, vacancy at the same time
+TRACE_EVENT(kaudio_irq,
+  TP_PROTO(unsigned int minor, u32 status, u32 vacancy),
+  TP_ARGS(minor, status, vacancy),
+  TP_STRUCT__entry(
+    __field(unsigned int, minor)
+    __field(u32, status)
+    __field(u32, vacancy)
+  ),
+  TP_fast_assign(
+    __entry->minor = minor;
+    __entry->status = status;
+    __entry->vacancy = vacancy;
+  ),
+  TP_printk("minor=%u status=0x%08x vacancy=%u", __entry->minor,
+            __entry->status, __entry->vacancy)
+);
+
+TRACE_EVENT(kaudio_tx_overrun_reset,
+  TP_PROTO(unsigned int minor, u64 words_written),
+  TP_ARGS(minor, words_written),
+  TP_STRUCT__entry(
+    __field(unsigned int, minor)
+    __field(u64, words_written)
+  ),
+  TP_fast_assign(
+    __entry->minor = minor;
+    __entry->words_written = words_written;
+  ),
+  TP_printk("minor=%u words_written=%llu", __entry->minor,
+            (unsigned long long)__entry->words_written)
+);
+
+// underrun concealed/stopped or overrun reset, frame as in zedaudio_xrun
+TRACE_EVENT(kaudio_xrun,
+  TP_PROTO(unsigned int minor, u32 type, u64 frame),
+  TP_ARGS(minor, type, frame),
+  TP_STRUCT__entry(
+    __field(unsigned int, minor)
+    __field(u32, type)
+    __field(u64, frame)
+  ),
+  TP_fast_assign(
+    __entry->minor = minor;
+    __entry->type = type;
+    __entry->frame = frame;
+  ),
+  TP_printk("minor=%u type=%u frame=%llu", __entry->minor, __entry->type,
+            (unsigned long long)__entry->frame)
+);
+
+#endif
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE kaudio_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,285 @@
+/* Round-trip latency measurement through a zedaudio instance.
+   Streams silence with a periodic impulse into the TX side and times how
+   long it takes the impulse to come back on the RX side (line out wired to
+   line in). With -e the device is replaced by an emulated backend that
+   paces a pipe at the sample rate, so buffer sizing can be tried without
+   hardware. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+
+#define DEFAULT_DEVICE   "/dev/zedaudio0"
+#define DEFAULT_RATE     48000
+#define DEFAULT_PERIOD   256
+#define DEFAULT_COUNT    20
+// emulated backend TX buffering, stands in for the AXI FIFO depth
+#define EMU_FIFO_WORDS   1024
+
+#define MAX_PERIOD       4096
+#define CHANNELS         2
+#define IMPULSE_WORD     0x7FFFFF00
+#define IMPULSE_DETECT   0x20000000
+// periods between impulses, leaves room for the previous one to return
+#define IMPULSE_INTERVAL 32
+// give up on an impulse that has not returned after this long
+#define IMPULSE_TIMEOUT_NS 1000000000ull
+
+struct emu_backend
+{
+  int tx_fd; // read end of the player -> "codec" pipe
+  int rx_fd; // write end of the "codec" -> player pipe
+  unsigned int rate;
+  unsigned int period;
+};
+
+void pr_usage(char* pname)
+{
+  printf("usage: %s [-d DEVICE] [-e] [-r RATE] [-p PERIOD_FRAMES] [-n COUNT]\n",
+         pname);
+}
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* @brief Emulated codec: every period, consume one period of TX words and
+   hand it back on RX, silence if the player underran */
+static void* emu_thread(void* arg)
+{
+  struct emu_backend* emu = arg;
+  uint32_t buf[MAX_PERIOD * CHANNELS];
+  size_t bytes = emu->period * CHANNELS * sizeof(uint32_t);
+  struct timespec next;
+  ssize_t got, ret;
+  size_t off;
+
+  clock_gettime(CLOCK_MONOTONIC, &next);
+
+  while (1)
+    {
+      next.tv_nsec += (long)emu->period * 1000000000l / emu->rate;
+      while (next.tv_nsec >= 1000000000l)
+        {
+          next.tv_nsec -= 1000000000l;
+          next.tv_sec++;
+        }
+      clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+
+      memset(buf, 0, bytes);
+      got = read(emu->tx_fd, buf, bytes);
+      if (got == 0)
+        break;
+
+      for (off = 0; off < bytes; off += ret)
+        {
+          ret = write(emu->rx_fd, (uint8_t*)buf + off, bytes - off);
+          if (ret < 0)
+            return NULL;
+        }
+    }
+
+  return NULL;
+}
+
+/* @brief Set up pipes and start the emulated backend
+   @return 0 on success, < 0 on error */
+int emu_start(struct emu_backend* emu, pthread_t* thread, int* tx_fd, int* rx_fd)
+{
+  int tx[2], rx[2];
+
+  if (pipe(tx) || pipe(rx))
+    return -errno;
+
+  // limit queued TX data like the hardware FIFO would
+  fcntl(tx[1], F_SETPIPE_SZ, EMU_FIFO_WORDS * sizeof(uint32_t));
+  fcntl(tx[0], F_SETFL, O_NONBLOCK);
+
+  emu->tx_fd = tx[0];
+  emu->rx_fd = rx[1];
+  *tx_fd = tx[1];
+  *rx_fd = rx[0];
+
+  if (pthread_create(thread, NULL, emu_thread, emu))
+    return -EAGAIN;
+
+  return 0;
+}
+
+int main(int argc, char** argv)
+{
+  const char* device = DEFAULT_DEVICE;
+  unsigned int rate = DEFAULT_RATE;
+  unsigned int period = DEFAULT_PERIOD;
+  unsigned int count = DEFAULT_COUNT;
+  int emulate = 0;
+  struct emu_backend emu;
+  pthread_t thread;
+  int tx_fd, rx_fd;
+  uint32_t tx_buf[MAX_PERIOD * CHANNELS];
+  uint32_t rx_buf[MAX_PERIOD * CHANNELS];
+  struct pollfd pfd[2];
+  uint64_t sent_at = 0, lat, lat_min = UINT64_MAX, lat_max = 0, lat_sum = 0;
+  unsigned int periods = 0, measured = 0, i;
+  int pending = 0;
+  ssize_t ret;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "d:er:p:n:")) != -1)
+    {
+      switch (opt)
+        {
+        case 'd':
+          device = optarg;
+          break;
+        case 'e':
+          emulate = 1;
+          break;
+        case 'r':
+          rate = strtoul(optarg, NULL, 0);
+          break;
+        case 'p':
+          period = strtoul(optarg, NULL, 0);
+          break;
+        case 'n':
+          count = strtoul(optarg, NULL, 0);
+          break;
+        default:
+          pr_usage(argv[0]);
+          return 1;
+        }
+    }
+
+  if (!rate || !period || period > MAX_PERIOD || !count)
+    {
+      pr_usage(argv[0]);
+      return 1;
+    }
+
+  if (emulate)
+    {
+      emu.rate = rate;
+      emu.period = period;
+      ret = emu_start(&emu, &thread, &tx_fd, &rx_fd);
+      if (ret)
+        {
+          printf("Could not start emulated backend: %s\n", strerror(-ret));
+          return 1;
+        }
+      printf("Using emulated backend, %u word TX buffer\n", EMU_FIFO_WORDS);
+    }
+  else
+    {
+      // one full-duplex open of the instance
+      tx_fd = open(device, O_RDWR | O_NONBLOCK);
+      if (tx_fd < 0)
+        {
+          printf("Could not open %s: %s\n", device, strerror(errno));
+          return 1;
+        }
+      rx_fd = tx_fd;
+    }
+
+  printf("Rate %u Hz, period %u frames (%.2f ms), %u impulses\n",
+         rate, period, period * 1000.0 / rate, count);
+
+  pfd[0].fd = tx_fd;
+  pfd[0].events = POLLOUT;
+  pfd[1].fd = rx_fd;
+  pfd[1].events = POLLIN;
+
+  while (measured < count)
+    {
+      if (tx_fd == rx_fd)
+        {
+          pfd[0].events = POLLOUT | POLLIN;
+          ret = poll(pfd, 1, 1000);
+          pfd[1].revents = pfd[0].revents & POLLIN;
+        }
+      else
+        {
+          ret = poll(pfd, 2, 1000);
+        }
+
+      if (ret == 0)
+        {
+          printf("Timed out, is TX/RX enabled and looped back?\n");
+          break;
+        }
+      if (ret < 0)
+        {
+          printf("poll failed: %s\n", strerror(errno));
+          break;
+        }
+
+      if (pending && now_ns() - sent_at > IMPULSE_TIMEOUT_NS)
+        {
+          printf("\timpulse lost\n");
+          pending = 0;
+        }
+
+      if (pfd[0].revents & POLLOUT)
+        {
+          memset(tx_buf, 0, period * CHANNELS * sizeof(uint32_t));
+          if (!pending && (periods % IMPULSE_INTERVAL) == 0)
+            {
+              tx_buf[0] = tx_buf[1] = IMPULSE_WORD;
+            }
+
+          ret = write(tx_fd, tx_buf, period * CHANNELS * sizeof(uint32_t));
+          if (ret > 0 && tx_buf[0])
+            {
+              // a short write still carries the impulse, it is the first word
+              sent_at = now_ns();
+              pending = 1;
+            }
+          if (ret > 0)
+            periods++;
+        }
+
+      if (pfd[1].revents & POLLIN)
+        {
+          ret = read(rx_fd, rx_buf, sizeof(rx_buf));
+          for (i = 0; pending && ret > 0 && i < ret / sizeof(uint32_t); i++)
+            {
+              if ((int32_t)rx_buf[i] > IMPULSE_DETECT ||
+                  (int32_t)rx_buf[i] < -IMPULSE_DETECT)
+                {
+                  lat = now_ns() - sent_at;
+                  pending = 0;
+                  measured++;
+                  lat_sum += lat;
+                  if (lat < lat_min)
+                    lat_min = lat;
+                  if (lat > lat_max)
+                    lat_max = lat;
+                  printf("\timpulse %u: %.3f ms\n", measured, lat / 1e6);
+                }
+            }
+        }
+    }
+
+  if (measured)
+    {
+      printf("Round trip: min %.3f ms, avg %.3f ms, max %.3f ms\n",
+             lat_min / 1e6, lat_sum / 1e6 / measured, lat_max / 1e6);
+    }
+
+  close(tx_fd);
+  if (rx_fd != tx_fd)
+    close(rx_fd);
+
+  return measured ? 0 : 1;
+}
@@ -12,69 +12,219 @@
 #include <sys/mman.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <signal.h>
+#include <limits.h>
+#include <math.h>
+#include <sys/resource.h>
+
+#include "dsp.h"
+#include "flac.h"
+#include "group.h"
+#include "kaudio/kaudio.h"
+#include "trace_marker.h"
 
 // NOTE use sizes from STDINT
 // NOTE verify data alignment!
-struct wave_header
+// RIFF chunk header, every chunk in the file starts with one
+struct riff_chunk
 {
-  // RIFF Chunk descriptor
-  uint32_t chunk_id;        // B   "RIFF" 0x52494646 BE
-  uint32_t chunk_size;      // L   36 + SubChunk2Size. Entire file - 8 bytes
-  uint32_t format;          // B   "WAVE" 0x57415645 BE
-  // FMT sub-chunk
-  uint32_t subchunk_1_id;   // B   "fmt " 0x666d7420 BE
-  uint32_t subchunk_1_size; // L   16 for PCM
-  uint16_t audio_format;    // L   PCM = 1, else Compressed
+  uint32_t id;              // B   chunk ID
+  uint32_t size;            // L   chunk body size, body is padded to even length
+} __attribute__((packed));
+
+// FMT sub-chunk body
+struct wave_fmt
+{
+  uint16_t audio_format;    // L   PCM = 1, Extensible = 0xFFFE, else Compressed
   uint16_t num_channels;    // L   1 = Mono, 2 = Stereo, etc
   uint32_t sample_rate;     // L   8000, 44100, etc
   uint32_t byte_rate;       // L   SampleRate * Num channels * Bits per sample / 8
   uint16_t block_align;     // L   Num Channels * bits per samlple/8. Bytes per sample inclusive of channels
   uint16_t bits_per_sample; // L   8, 16, etc
+  // WAVE_FORMAT_EXTENSIBLE only
+  uint16_t extension_size;  // L   22
+  uint16_t valid_bits;      // L   valid bits in each sample container
+  uint32_t channel_mask;    // L   speaker positions
+  uint16_t sub_format;      // L   first two bytes of the sub-format GUID, PCM = 1
+  uint8_t  guid_rest[14];
+} __attribute__((packed));
+
+// DS64 chunk body (RF64/BW64), carries the sizes that overflow 32 bits
+struct ds64_chunk
+{
+  uint64_t riff_size;       // L   entire file - 8 bytes
+  uint64_t data_size;       // L   size of the data chunk body
+  uint64_t sample_count;    // L   frames in the data chunk
+  uint32_t table_length;    // L   entries in the chunk size table that follows
+} __attribute__((packed));
+
+// WAVE stream description assembled from the RIFF/RF64 chunks
+struct wave_header
+{
+  // RIFF Chunk descriptor
+  uint32_t chunk_id;        // B   "RIFF", "RF64" or "BW64"
+  uint64_t chunk_size;      //     Entire file - 8 bytes, from ds64 for RF64
+  uint32_t format;          // B   "WAVE" 0x57415645 BE
+  // FMT sub-chunk
+  uint32_t subchunk_1_size; //     16 for PCM, 40 for extensible
+  uint16_t audio_format;
+  uint16_t num_channels;
+  uint32_t sample_rate;
+  uint32_t byte_rate;
+  uint16_t block_align;
+  uint16_t bits_per_sample;
   // DATA sub-chunk
-  uint32_t subchunk_2_id;   // B   "data" 0x64617461 BE
-  uint32_t subchunk_2_size; // L   num samples * num channels * bits per sample/8
-} __attribute__((aligned(4)));
+  uint64_t data_offset;     //     file offset of the first frame
+  uint64_t subchunk_2_size; //     num samples * num channels * bits per sample/8
+};
 
 #define CHUNK_ID      be32toh(0x52494646)
+#define RF64_ID       be32toh(0x52463634)
+#define BW64_ID       be32toh(0x42573634)
 #define FORMAT        be32toh(0x57415645)
+#define DS64_ID       be32toh(0x64733634)
 #define SUBCHUNK1_ID  be32toh(0x666d7420)
 #define SUBCHUNK2_ID  be32toh(0x64617461)
-#define WAVE_HEADER_SIZE sizeof(struct wave_header)
+// RF64 marks 32-bit sizes that live in the ds64 chunk with this value
+#define RF64_SIZE_IN_DS64 0xFFFFFFFF
+#define WAVE_FORMAT_PCM        1
+#define WAVE_FORMAT_EXTENSIBLE 0xFFFE
+// RIFF header and WAVE format ID
+#define RIFF_HEADER_SIZE 12
+
+// frames converted, processed and written per iteration
+#define PLAY_BLOCK_FRAMES 256
+// largest supported frame: a stereo pair per zone, 32 bits per sample
+#define MAX_BLOCK_ALIGN (MAX_ZONES * DSP_CHANNELS * 4)
+
+// set by SIGINT, playback stops after the current block and drains
+static volatile sig_atomic_t stop_requested;
+
+static void handle_sigint(int sig)
+{
+  (void)sig;
+  stop_requested = 1;
+}
 
 void pr_usage(char* pname)
 {
-  printf("usage: %s WAV_FILE\n", pname);
+  printf("usage: %s [-c DSP_CONFIG] [-u] [-t] [-x silence|repeat|stop] [-s START] [-d DURATION] [-L LOOPS] [-z DEVICE[,I2S_TX_ENABLED]]... WAV_FILE|FLAC_FILE\n", pname);
+  printf("\t-s/-d select a region, in frames (44100), seconds (1.5s) or M:SS.s.\n"
+         "\t-L plays the region LOOPS times without a gap, 0 loops until Ctrl-C.\n");
+  printf("\t-u expands samples in userspace even if the driver could do it.\n");
+  printf("\t-t writes per-block markers to the ftrace buffer, see tracetl.\n");
+  printf("\t-x lets the driver fill underruns with silence, the last period,\n"
+         "\t   or stop until the next write. The player skips ahead to stay in time.\n");
+  printf("\t-z may be repeated up to %d times, all zones start on the same sample.\n"
+         "\t   Only the first zone may leave out I2S_TX_ENABLED, it defaults to\n"
+         "\t   %s.\n"
+         "\t   Mono/stereo files play on every zone, files with two channels\n"
+         "\t   per zone are split into consecutive pairs.\n", MAX_ZONES,
+         DEFAULT_ZONE_I2S);
+}
+
+/* @brief Map an -x argument to a ZEDAUDIO_XRUN_* policy
+   @return policy, < 0 if unknown */
+int xrun_policy_from_name(const char* name)
+{
+  if(!strcmp(name, "silence"))
+    return ZEDAUDIO_XRUN_SILENCE;
+  if(!strcmp(name, "repeat"))
+    return ZEDAUDIO_XRUN_REPEAT;
+  if(!strcmp(name, "stop"))
+    return ZEDAUDIO_XRUN_STOP;
+
+  return -EINVAL;
 }
 
-/* @brief Read WAVE header
+/* @brief Read WAVE header, walks the chunks up to the data chunk
    @param fp file pointer
    @param dest destination struct
    @return 0 on success, < 0 on error */
 int read_wave_header(FILE* fp, struct wave_header* dest)
 {
-  int size = sizeof(struct wave_header);
-  size_t ret;
+  struct riff_chunk chunk;
+  struct wave_fmt fmt;
+  struct ds64_chunk ds64;
+  int have_fmt = 0;
+  int have_ds64 = 0;
+  off_t pos;
 
   if (!dest || !fp)
     {
       return -ENOENT;
     }
 
+  memset(dest, 0, sizeof(*dest));
+
   // NOTE do not assume file pointer is at its starting point
-  if(fseek(fp, 0, SEEK_SET))
+  if(fseeko(fp, 0, SEEK_SET))
     return errno;
 
-  printf("Seeked to beginning of file\n");
+  if(fread(&chunk, sizeof(chunk), 1, fp) != 1 ||
+     fread(&dest->format, sizeof(dest->format), 1, fp) != 1)
+    return -ENODATA;
 
-  // read 44 bytes from file and store in wave header ptr
-  ret = fread(dest, 1, size, fp);
+  dest->chunk_id = chunk.id;
+  dest->chunk_size = chunk.size;
+  pos = RIFF_HEADER_SIZE;
 
-  printf("Read %d bytes from file\n", (int)ret);
+  while(fread(&chunk, sizeof(chunk), 1, fp) == 1)
+  {
+    pos += sizeof(chunk);
 
-  if(ret != size)
-    return -ENODATA;
+    if(chunk.id == DS64_ID)
+    {
+      memset(&ds64, 0, sizeof(ds64));
+      if(chunk.size < 3 * sizeof(uint64_t) ||
+         fread(&ds64, 1, chunk.size < sizeof(ds64) ? chunk.size : sizeof(ds64), fp) < 3 * sizeof(uint64_t))
+        return -ENODATA;
 
-  return 0;
+      have_ds64 = 1;
+      dest->chunk_size = ds64.riff_size;
+    }
+    else if(chunk.id == SUBCHUNK1_ID)
+    {
+      memset(&fmt, 0, sizeof(fmt));
+      if(chunk.size < 16 ||
+         fread(&fmt, 1, chunk.size < sizeof(fmt) ? chunk.size : sizeof(fmt), fp) < 16)
+        return -ENODATA;
+
+      have_fmt = 1;
+      dest->subchunk_1_size = chunk.size;
+      dest->audio_format = fmt.audio_format;
+      dest->num_channels = fmt.num_channels;
+      dest->sample_rate = fmt.sample_rate;
+      dest->byte_rate = fmt.byte_rate;
+      dest->block_align = fmt.block_align;
+      dest->bits_per_sample = fmt.bits_per_sample;
+
+      // extensible PCM plays like plain PCM
+      if(fmt.audio_format == WAVE_FORMAT_EXTENSIBLE &&
+         chunk.size >= sizeof(fmt) && fmt.sub_format == WAVE_FORMAT_PCM)
+        dest->audio_format = WAVE_FORMAT_PCM;
+    }
+    else if(chunk.id == SUBCHUNK2_ID)
+    {
+      if(!have_fmt)
+        return -ENODATA;
+
+      dest->data_offset = pos;
+      if(have_ds64 && chunk.size == RF64_SIZE_IN_DS64)
+        dest->subchunk_2_size = ds64.data_size;
+      else
+        dest->subchunk_2_size = chunk.size;
+
+      return 0;
+    }
+
+    // skip to the next chunk, bodies are padded to even size
+    pos += (off_t)chunk.size + (chunk.size & 1);
+    if(fseeko(fp, pos, SEEK_SET))
+      return errno;
+  }
+
+  return -ENODATA;
 }
 
 /* @brief Parse WAVE header and print parameters
@@ -83,13 +233,13 @@ int read_wave_header(FILE* fp, struct wave_header* dest)
 int parse_wave_header(struct wave_header hdr)
 {
   // verify that this is a RIFF file header
-  if(hdr.chunk_id != CHUNK_ID)
+  if(hdr.chunk_id != CHUNK_ID && hdr.chunk_id != RF64_ID && hdr.chunk_id != BW64_ID)
   {
     printf("Header not RIFF !\n");
     return 1;
   }
 
-  printf("Found RIFF Header\n");
+  printf("Found %s Header\n", hdr.chunk_id == CHUNK_ID ? "RIFF" : "RF64");
 
   // verify that this is WAVE file
   if(hdr.format != FORMAT)
@@ -99,14 +249,11 @@ int parse_wave_header(struct wave_header hdr)
   }
 
   printf("File format: WAVE\n");
-  printf("\tWAV File size: %d\n", hdr.chunk_size + 8);
+  printf("\tWAV File size: %llu\n", (unsigned long long)hdr.chunk_size + 8);
 
-  if((hdr.subchunk_1_id != SUBCHUNK1_ID) ||
-     (hdr.subchunk_1_size != 16) ||
-     (hdr.audio_format != 1))
+  if(hdr.audio_format != WAVE_FORMAT_PCM)
   {
     printf("Audio format not PCM!\n");
-    printf("Subchunk 1 id: %x\n", be32toh(hdr.subchunk_1_id));
     printf("subchunk 1 size: %u\n", hdr.subchunk_1_size);
     printf("Audio format: %u\n", hdr.audio_format);
     return 1;
@@ -121,15 +268,16 @@ int parse_wave_header(struct wave_header hdr)
   printf("\tBlock align: %d byte(s)\n", hdr.block_align);
   printf("\tBits per sample: %d bits\n", hdr.bits_per_sample);
 
-  if(hdr.subchunk_2_id != SUBCHUNK2_ID)
+  if(!hdr.block_align)
   {
-    printf("Subchunk 2 ID invalid!\n");
+    printf("Block align invalid!\n");
     return 1;
   }
 
   printf("Data section information:\n");
-  printf("\tBytes in data section: %d\n", hdr.subchunk_2_size);
-  if(hdr.subchunk_2_size + 36 != hdr.chunk_size)
+  printf("\tBytes in data section: %llu\n", (unsigned long long)hdr.subchunk_2_size);
+  printf("\tData starts at byte: %llu\n", (unsigned long long)hdr.data_offset);
+  if(hdr.data_offset + hdr.subchunk_2_size > hdr.chunk_size + 8)
   {
     printf("Something wrong with chunk sizes\n");
     //return 1;
@@ -138,24 +286,6 @@ int parse_wave_header(struct wave_header hdr)
   return 0;
 }
 
-/* @brief Transmit a word (put into FIFO)
- * @param hdr wave_header struct for sample_rate
-   @param word a 32-bit word */
-void fifo_transmit_word(FILE * chardev, uint32_t word)
-{
-	int ret;
-	// write to kernel module
-	// Lab 4.4.1) Fwrite is buffered, and will store a page at a time to write. write will write
-	// exactly the number of bytes its told to write. Using write would cause a billion system calls
-	// and be slightly slower on average
-	ret = fwrite((void *)&word, 4, 1, chardev);
-
-	if(ret == 0)
-	{
-		printf("Error = %d\n", errno);
-	}
-}
-
 /* @brief Build a 32-bit audio word from a buffer
    @param hdr WAVE header
    @param buf a byte array
@@ -185,111 +315,456 @@ uint32_t audio_word_from_buf(struct wave_header hdr, uint8_t* buf)
   return audio_word;
 }
 
+/* @brief File offset of a frame, frames are fixed size so no index is needed
+   @param hdr WAVE header
+   @param frame frame number counted from the start of the data chunk
+   @return byte offset in the file */
+off_t wave_frame_offset(struct wave_header hdr, uint64_t frame)
+{
+  return hdr.data_offset + frame * hdr.block_align;
+}
+
+/* @brief Parse a stream position
+   @param arg frames ("44100"), seconds ("1.5s") or minutes ("2:03.5")
+   @param sample_rate stream sample rate in Hz
+   @param frames destination, position in frames
+   @return 0 on success, < 0 if the position cannot be parsed */
+int parse_position(const char* arg, unsigned int sample_rate, uint64_t* frames)
+{
+  char* end;
+  double seconds;
+  unsigned long long count;
+  int range;
+
+  // plain number: frames
+  errno = 0;
+  count = strtoull(arg, &end, 10);
+  range = errno == ERANGE;
+  if(end != arg && !*end && *arg != '-')
+  {
+    if(range)
+      return -ERANGE;
+    *frames = count;
+    return 0;
+  }
+
+  // M:SS.s
+  if(*end == ':' && *arg != '-')
+  {
+    if(range)
+      return -ERANGE;
+    errno = 0;
+    seconds = strtod(end + 1, &end);
+    if(*end || seconds < 0)
+      return -EINVAL;
+    seconds += count * 60.0;
+  }
+  else
+  {
+    errno = 0;
+    seconds = strtod(arg, &end);
+    if(end == arg || strcmp(end, "s") || seconds < 0)
+      return -EINVAL;
+  }
+
+  if(errno == ERANGE || !isfinite(seconds))
+    return -ERANGE;
+
+  // 2^64, the cast of anything at or above it is undefined
+  seconds = seconds * sample_rate + 0.5;
+  if(seconds >= 18446744073709551616.0)
+    return -ERANGE;
+
+  *frames = (uint64_t)seconds;
+
+  return 0;
+}
+
+/* @brief Fill a block from the region, wrapping to its start at the loop point
+   @param fp file pointer
+   @param hdr WAVE header
+   @param in destination, frames * block_align bytes
+   @param frames frames to read
+   @param pos current frame, advanced
+   @param start first frame of the region
+   @param end frame after the region
+   @param wrap non-zero if reading continues at start after end
+   @return frames read, fewer than asked for if the file is short */
+size_t read_region_frames(FILE* fp, struct wave_header hdr, uint8_t* in,
+                          size_t frames, uint64_t* pos, uint64_t start,
+                          uint64_t end, int wrap)
+{
+  size_t filled = 0;
+  size_t n, got;
+
+  while(filled < frames)
+  {
+    // at the loop point, the block continues with the region start
+    if(*pos == end)
+    {
+      if(!wrap || fseeko(fp, wave_frame_offset(hdr, start), SEEK_SET))
+        break;
+      *pos = start;
+    }
+
+    n = frames - filled;
+    if(n > end - *pos)
+      n = end - *pos;
+
+    got = fread(in + filled * hdr.block_align, hdr.block_align, n, fp);
+    filled += got;
+    *pos += got;
+
+    if(got != n)
+      break;
+  }
+
+  return filled;
+}
+
+/* @brief Run a zone's DSP chain over a block and write it to the zone
+   @param group output zones
+   @param z zone index
+   @param out left-justified stereo words, processed in place
+   @param frames frames in the block
+   @return 0 on success, < 0 on error */
+int write_zone_block(struct audio_group* group, unsigned int z, uint32_t* out,
+                     size_t frames)
+{
+  int err;
+
+  dsp_chain_process(&group->zones[z].chain, (int32_t*)out, frames);
+
+  // Lab 4.4.1) write will write exactly the number of bytes its told to write,
+  // whole blocks are handed over at once so there is no need for stdio buffering
+  err = audio_group_write(group, z, out, frames * sizeof(uint32_t) * DSP_CHANNELS);
+  if(err && !(err == -EINTR && stop_requested))
+    printf("Error = %d\n", -err);
+
+  return err;
+}
+
 /* @brief Play sound samples
    @param fp file pointer
+   @param group output zones, each with its own DSP chain
    @param hdr WAVE header
-   @param sample_count how many samples to play or -1 plays to end of file
-   @param start starting point in file for playing
+   @param sample_count how many samples (frames) to play
+   @param start starting frame in the data chunk
+   @param loops times the region is played back to back, 0 repeats forever
+   @param played destination, frames written to every zone
    @return 0 if successful, < 0 otherwise */
 int play_wave_samples(FILE* fp,
-					  FILE* chardev,
+                      struct audio_group* group,
                       struct wave_header hdr,
-                      int sample_count,
-                      unsigned int start)
+                      uint64_t sample_count,
+                      uint64_t start,
+                      unsigned int loops,
+                      uint64_t* played)
 {
-  unsigned int start_byte = WAVE_HEADER_SIZE + (start * hdr.block_align);
-  uint32_t sample;
-  // Note: this gets really annoying if we're at for example 24 bits per sample.
-  // Worry about that later
-  uint32_t bytes_per_sample = hdr.bits_per_sample/8;
-  size_t samples_read;
+  off_t start_byte = wave_frame_offset(hdr, start);
+  uint8_t in[PLAY_BLOCK_FRAMES * MAX_BLOCK_ALIGN];
+  uint32_t out[PLAY_BLOCK_FRAMES * DSP_CHANNELS];
+  uint32_t bytes_per_sample;
+  unsigned int left, right, z;
+  size_t frames, frames_read, i;
+  uint8_t* frame;
+  uint64_t block = 0;
+  uint64_t pos = start;
+  uint64_t end = start + sample_count;
+  uint64_t remaining;
+  int err;
 
   if (!fp)
   {
     return -EINVAL;
   }
 
-  // NOTE reject if number of channels is not 1 or 2
-  if(hdr.num_channels != 1 && hdr.num_channels != 2)
+  // NOTE reject if channels cannot be mapped onto the zones: mono and
+  // stereo go to every zone, otherwise one stereo pair per zone
+  if(hdr.num_channels != 1 && hdr.num_channels != 2 &&
+     hdr.num_channels != DSP_CHANNELS * group->count)
   {
-    printf("Number of channels: (%u) is invalid!", hdr.num_channels);
+    printf("Number of channels: (%u) is invalid for %u zone(s)!",
+           hdr.num_channels, group->count);
     return -EINVAL;
   }
 
+  // frames must fit the block buffer, 24-bit samples take 3 bytes
+  bytes_per_sample = hdr.block_align / hdr.num_channels;
+  if(!bytes_per_sample || bytes_per_sample > 4 ||
+     hdr.bits_per_sample > 8 * bytes_per_sample)
+  {
+    printf("Block align (%u) is invalid!", hdr.block_align);
+    return -EINVAL;
+  }
+
+  if(!sample_count)
+  {
+    return 0;
+  }
+
   //calculate starting point and move there
-  if(fseek(fp, start_byte, SEEK_SET))
+  if(fseeko(fp, start_byte, SEEK_SET))
     return errno;
 
-  // continuously read frames/samples and use fifo_transmit_word to
-  // simulate transmission
-  while (sample_count > 0)
+  // loops run back to back, blocks straddle the loop point so the FIFOs
+  // never drain and the DSP state carries over
+  remaining = loops ? sample_count * loops : UINT64_MAX;
+
+  // continuously read blocks of frames, convert to 32-bit words,
+  // run the DSP chain and write the block to each zone's FIFO
+  while (remaining > 0 && !stop_requested)
     {
-      // read chunk (whole frame)
-      samples_read = fread(&sample, bytes_per_sample, 1, fp);
+      frames = remaining < PLAY_BLOCK_FRAMES ? remaining : PLAY_BLOCK_FRAMES;
 
-      fifo_transmit_word(chardev, audio_word_from_buf(hdr, (uint8_t *)&sample));
+      trace_marker("block %llu begin frames=%zu", (unsigned long long)block, frames);
 
-      if(samples_read != 1){
-    	 //printf("LEFT: Tried to read %d bytes but read %d instead!\n", bytes_per_sample, bytes_read);
-        return -ENODATA;
+      frames_read = read_region_frames(fp, hdr, in, frames, &pos, start, end,
+                                       remaining > end - pos);
+
+      // driver expands the samples, hand over file data as is
+      for(z = 0; group->raw && z < group->count; z++)
+      {
+        err = audio_group_write(group, z, in, frames_read * hdr.block_align);
+        if(err == -EINTR && stop_requested)
+          return 0;
+        if(err)
+        {
+          printf("Error = %d\n", -err);
+          return err;
+        }
       }
 
-      // write samples properly independently if file is mono or stereo
-      if(hdr.num_channels == 2)
+      for(z = 0; !group->raw && z < group->count; z++)
       {
-        samples_read = fread(&sample, bytes_per_sample, 1, fp);
-        if(samples_read != 1)
+        // write samples properly independently if file is mono or stereo
+        left = hdr.num_channels > 2 ? z * DSP_CHANNELS : 0;
+        right = hdr.num_channels > 1 ? left + 1 : left;
+
+        for(i = 0; i < frames_read; i++)
         {
-            return -ENODATA;
+          frame = in + i * hdr.block_align;
+          out[i * DSP_CHANNELS] = audio_word_from_buf(hdr, frame + left * bytes_per_sample);
+          out[i * DSP_CHANNELS + 1] = audio_word_from_buf(hdr, frame + right * bytes_per_sample);
         }
+
+        err = write_zone_block(group, z, out, frames_read);
+        if(err == -EINTR && stop_requested)
+          return 0;
+        if(err)
+          return err;
       }
 
-      fifo_transmit_word(chardev, audio_word_from_buf(hdr, (uint8_t *)&sample));
+      trace_marker("block %llu end", (unsigned long long)block);
+      block++;
+      *played += frames_read;
+
+      if(frames_read != frames){
+        return -ENODATA;
+      }
 
-      sample_count--;
+      if(loops)
+        remaining -= frames;
     }
 
   return 0;
 }
 
-int i2s_enable_tx(void)
+/* @brief Print FLAC stream parameters
+   @param info STREAMINFO of the file
+   @return 0 on success, 1 if the stream cannot be played */
+int parse_flac_info(const struct flac_stream_info* info)
+{
+  printf("Found FLAC stream\n");
+  printf("\tNumber of channels: %u\n", info->channels);
+  printf("\tSample rate: %u Hz\n", info->sample_rate);
+  printf("\tBits per sample: %u bits\n", info->bits_per_sample);
+  printf("\tBlock size: %u-%u frames\n", info->min_block_size, info->max_block_size);
+  if(info->total_samples)
+    printf("\tTotal frames: %llu\n", (unsigned long long)info->total_samples);
+  else
+    printf("\tTotal frames: unknown\n");
+
+  return 0;
+}
+
+/* @brief Fill a block from the region of a FLAC stream, like
+   read_region_frames() but the loop point is a decoder seek
+   @param dec FLAC decoder
+   @param in destination, frames * channels words
+   @param frames frames to read
+   @param pos current frame, advanced
+   @param start first frame of the region
+   @param end frame after the region
+   @param wrap non-zero if reading continues at start after end
+   @return frames read, fewer than asked for at the end of the stream */
+size_t read_flac_region_frames(struct flac_decoder* dec, int32_t* in,
+                               size_t frames, uint64_t* pos, uint64_t start,
+                               uint64_t end, int wrap)
+{
+  size_t filled = 0;
+  size_t n, got;
+
+  while(filled < frames)
+  {
+    // the frame holding start is remembered, wrapping decodes only that one
+    if(*pos == end)
+    {
+      if(!wrap || flac_seek(dec, start))
+        break;
+      *pos = start;
+    }
+
+    n = frames - filled;
+    if(n > end - *pos)
+      n = end - *pos;
+
+    got = flac_read_frames(dec, in + filled * dec->info.channels, n);
+    filled += got;
+    *pos += got;
+
+    if(got != n)
+      break;
+  }
+
+  return filled;
+}
+
+/* @brief Play a FLAC stream, decoded blocks go through the same DSP and
+   output path as WAVE data
+   @param dec opened FLAC decoder
+   @param group output zones, each with its own DSP chain
+   @param sample_count how many samples (frames) to play
+   @param start starting frame
+   @param loops times the region is played back to back, 0 repeats forever
+   @param played destination, frames written to every zone
+   @return 0 if successful, < 0 otherwise */
+int play_flac_samples(struct flac_decoder* dec,
+                      struct audio_group* group,
+                      uint64_t sample_count,
+                      uint64_t start,
+                      unsigned int loops,
+                      uint64_t* played)
 {
-	ssize_t numwritten;
-	char buf = '1';
-	int fd = open("/sys/devices/soc0/amba_pl/77600000.axi_i2s_adi/tx_enabled", O_WRONLY);
+  int32_t in[PLAY_BLOCK_FRAMES * FLAC_MAX_CHANNELS];
+  uint32_t out[PLAY_BLOCK_FRAMES * DSP_CHANNELS];
+  unsigned int channels = dec->info.channels;
+  unsigned int left, right, z;
+  size_t frames, frames_read, i;
+  uint64_t block = 0;
+  uint64_t pos = start;
+  uint64_t end = start + sample_count;
+  uint64_t remaining;
+  int err;
+
+  // same channel mapping as WAVE files
+  if(channels != 1 && channels != 2 && channels != DSP_CHANNELS * group->count)
+  {
+    printf("Number of channels: (%u) is invalid for %u zone(s)!",
+           channels, group->count);
+    return -EINVAL;
+  }
+
+  if(!sample_count)
+  {
+    return 0;
+  }
+
+  err = flac_seek(dec, start);
+  if(err)
+    return err;
+
+  remaining = loops ? sample_count * loops : UINT64_MAX;
+
+  while (remaining > 0 && !stop_requested)
+    {
+      frames = remaining < PLAY_BLOCK_FRAMES ? remaining : PLAY_BLOCK_FRAMES;
+
+      trace_marker("block %llu begin frames=%zu", (unsigned long long)block, frames);
+
+      frames_read = read_flac_region_frames(dec, in, frames, &pos, start, end,
+                                            remaining > end - pos);
 
-	if(fd == -1)
-		return errno;
+      for(z = 0; z < group->count; z++)
+      {
+        left = channels > 2 ? z * DSP_CHANNELS : 0;
+        right = channels > 1 ? left + 1 : left;
+
+        // decoder output is already left-justified
+        for(i = 0; i < frames_read; i++)
+        {
+          out[i * DSP_CHANNELS] = in[i * channels + left];
+          out[i * DSP_CHANNELS + 1] = in[i * channels + right];
+        }
 
-	numwritten = write(fd, &buf, sizeof(char));
+        err = write_zone_block(group, z, out, frames_read);
+        if(err == -EINTR && stop_requested)
+          return 0;
+        if(err)
+          return err;
+      }
+
+      trace_marker("block %llu end", (unsigned long long)block);
+      block++;
+      *played += frames_read;
 
-	if(numwritten != sizeof(char))
-		return errno;
+      // streams without a length in STREAMINFO simply end
+      if(frames_read != frames){
+        return dec->info.total_samples ? -ENODATA : 0;
+      }
 
-	if(!close(fd))
-		return errno;
+      if(loops)
+        remaining -= frames;
+    }
 
-	return 0;
+  return 0;
 }
 
-int i2s_disable_tx(void)
+/* @brief Pick the driver input format for the file's samples
+   @param hdr WAVE header
+   @return ZEDAUDIO_FORMAT_* or < 0 if the driver cannot expand them */
+int driver_format(struct wave_header hdr)
 {
-	ssize_t numwritten;
-	char buf = '0';
-	int fd = open("/sys/devices/soc0/amba_pl/77600000.axi_i2s_adi/tx_enabled", O_WRONLY);
+  unsigned int bytes_per_sample = hdr.block_align / hdr.num_channels;
+
+  // driver only left-justifies whole containers
+  if(hdr.num_channels > 2 || hdr.bits_per_sample != 8 * bytes_per_sample)
+    return -EINVAL;
 
-	if(fd == -1)
-		return errno;
+  switch(bytes_per_sample)
+  {
+  case 2:
+    return ZEDAUDIO_FORMAT_S16_LE;
+  case 3:
+    return ZEDAUDIO_FORMAT_S24_3LE;
+  case 4:
+    return ZEDAUDIO_FORMAT_S32_LE;
+  default:
+    return -EINVAL;
+  }
+}
 
-	numwritten = write(fd, &buf, sizeof(char));
+/* @brief Print bytes written to the drivers and CPU time per audio second
+   @param group the group that played the stream
+   @param frames frames played
+   @param sample_rate stream sample rate in Hz */
+void report_stream_cost(struct audio_group* group, uint64_t frames,
+                        unsigned int sample_rate)
+{
+  struct rusage usage;
+  double seconds = (double)frames / sample_rate;
+  double user, sys;
 
-	if(numwritten != sizeof(char))
-		return errno;
+  if(!frames || getrusage(RUSAGE_SELF, &usage))
+    return;
 
-	if(!close(fd))
-		return errno;
+  user = usage.ru_utime.tv_sec * 1e3 + usage.ru_utime.tv_usec / 1e3;
+  sys = usage.ru_stime.tv_sec * 1e3 + usage.ru_stime.tv_usec / 1e3;
 
-	return 0;
+  printf("%s expansion: %.0f bytes written, %.2f ms CPU (user %.2f, sys %.2f) per audio second\n",
+         group->raw ? "Driver" : "Userspace",
+         group->bytes_written / seconds, (user + sys) / seconds,
+         user / seconds, sys / seconds);
 }
 
 int configure_codec(unsigned int sample_rate,
@@ -361,20 +836,104 @@ int main(int argc, char **argv)
   snd_pcm_format_t sound_format = SND_PCM_FORMAT_S32_LE;
 
   FILE* fp;
-  FILE* chardev;
   struct wave_header hdr;
+  struct flac_decoder dec;
+  int is_flac;
   int ret;
-
-  printf("Size of wave header: %lu\n", sizeof(struct wave_header));
+  int opt;
+  unsigned int z;
+  const char* dsp_config = NULL;
+  const char* wav_path;
+  int userspace_expand = 0;
+  int xrun_policy = -1;
+  const char* start_arg = NULL;
+  const char* duration_arg = NULL;
+  uint64_t total_frames, start = 0, sample_count;
+  uint64_t played = 0;
+  unsigned int loops = 1;
+  unsigned long count;
+  char* end;
+  struct sigaction sa;
+  struct dsp_chain chain;
+  struct audio_group group = { .count = 0 };
+  char default_zone[] = DEFAULT_ZONE_DEVICE;
+
+  while ((opt = getopt(argc, argv, "c:d:L:s:tux:z:")) != -1)
+  {
+    switch (opt)
+    {
+    case 'c':
+      dsp_config = optarg;
+      break;
+    case 'd':
+      duration_arg = optarg;
+      break;
+    case 'L':
+      // same rules as frame counts, a typo must not mean "forever"
+      count = strtoul(optarg, &end, 10);
+      if (end == optarg || *end || *optarg == '-' || count > UINT_MAX)
+      {
+        printf("Invalid loop count %s\n", optarg);
+        pr_usage(argv[0]);
+        return 1;
+      }
+      loops = count;
+      break;
+    case 's':
+      start_arg = optarg;
+      break;
+    case 't':
+      if (trace_marker_open())
+      {
+        printf("Could not open the ftrace marker, is tracefs mounted?\n");
+        return 1;
+      }
+      break;
+    case 'u':
+      userspace_expand = 1;
+      break;
+    case 'x':
+      xrun_policy = xrun_policy_from_name(optarg);
+      if (xrun_policy < 0)
+      {
+        pr_usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'z':
+      err = audio_group_add(&group, optarg);
+      if (err == -EINVAL)
+      {
+        printf("Zone %s needs its I2S tx_enabled path\n", optarg);
+        return 1;
+      }
+      if (err)
+      {
+        printf("At most %d zones are supported\n", MAX_ZONES);
+        return 1;
+      }
+      break;
+    default:
+      pr_usage(argv[0]);
+      return 1;
+    }
+  }
 
   // check number of arguments
-  if (argc < 2)
+  if (optind >= argc)
   {
       // fail, print usage
       pr_usage(argv[0]);
       return 1;
   }
 
+  wav_path = argv[optind];
+
+  if (!group.count)
+  {
+    audio_group_add(&group, default_zone);
+  }
+
   // allocate HW parameter data structures
   snd_pcm_hw_params_alloca(&hwparams);
 
@@ -390,102 +949,236 @@ int main(int argc, char **argv)
   // play sound (from pre-lab 4a)
 
   // open file
-  fp = fopen(argv[1], "r");
+  fp = fopen(wav_path, "r");
 
   if(!fp)
   {
-    printf("Could not open file %s for reading\n", argv[1]);
+    printf("Could not open file %s for reading\n", wav_path);
     snd_pcm_close(handle);
     return errno;
   }
 
- // initalize AXI FIFO, map /dev/mem offset for the AXI control registers
-  chardev = fopen("/dev/zedaudio0", "w");
-  if(!chardev)
+  // open the AXI FIFO instances, TX is held until they are prefilled
+  ret = audio_group_open(&group);
+  if(ret)
   {
-    printf("Failed to open kernel module %d:\n", errno);
+    printf("Failed to open kernel module %d:\n", -ret);
+    audio_group_close(&group);
     fclose(fp);
     snd_pcm_close(handle);
-    return errno;
+    return ret;
   }
 
-  // read file header
-  ret = read_wave_header(fp, &hdr);
-  if(ret)
+  // FLAC files are decoded in the player, anything else must be WAVE
+  ret = flac_open(&dec, fp);
+  is_flac = !ret;
+  if(ret && ret != -EINVAL)
   {
-    printf("Could not read wave header from %s\n", argv[1]);
-    fclose(chardev);
+    printf("Could not read FLAC metadata from %s\n", wav_path);
+    audio_group_close(&group);
     fclose(fp);
     snd_pcm_close(handle);
     return ret;
   }
 
-  // parse file header, verify that is wave
-  ret = parse_wave_header(hdr);
+  if(is_flac)
+  {
+    memset(&hdr, 0, sizeof(hdr));
+    ret = parse_flac_info(&dec.info);
+  }
+  else
+  {
+    // read file header
+    ret = read_wave_header(fp, &hdr);
+    if(ret)
+    {
+      printf("Could not read wave header from %s\n", wav_path);
+      audio_group_close(&group);
+      fclose(fp);
+      snd_pcm_close(handle);
+      return ret;
+    }
+
+    // parse file header, verify that is wave
+    ret = parse_wave_header(hdr);
+  }
+
   if(ret)
   {
-    printf("Error parsing wave header file %s\n", argv[1]);
-    fclose(chardev);
+    printf("Error parsing header of file %s\n", wav_path);
+    flac_close(&dec);
+    audio_group_close(&group);
     fclose(fp);
     snd_pcm_close(handle);
     return ret;
   }
 
-  sample_rate = hdr.sample_rate;
+  sample_rate = is_flac ? dec.info.sample_rate : hdr.sample_rate;
+
+  // region to play, WAVE positions map straight to file offsets, FLAC
+  // ones go through the seek table
+  if(is_flac)
+    total_frames = dec.info.total_samples ? dec.info.total_samples : UINT64_MAX;
+  else
+    total_frames = hdr.subchunk_2_size / hdr.block_align;
+  sample_count = total_frames;
+  if ((start_arg && parse_position(start_arg, sample_rate, &start)) ||
+      (duration_arg && parse_position(duration_arg, sample_rate, &sample_count)))
+  {
+    printf("Invalid start or duration\n");
+    pr_usage(argv[0]);
+    flac_close(&dec);
+    audio_group_close(&group);
+    fclose(fp);
+    snd_pcm_close(handle);
+    return 1;
+  }
 
-  err = configure_codec(sample_rate, sound_format, handle, hwparams);
-  if (err < 0)
+  if (start >= total_frames)
   {
-    printf("PANIC 7\n");
-    fclose(chardev);
+    printf("Start frame %llu is past the end (%llu frames)\n",
+           (unsigned long long)start, (unsigned long long)total_frames);
+    flac_close(&dec);
+    audio_group_close(&group);
     fclose(fp);
     snd_pcm_close(handle);
-    return -1;
+    return 1;
   }
 
-  err = i2s_enable_tx();
-  if (err < 0)
+  if (sample_count > total_frames - start)
   {
-	  printf("PANIC 8\n");
-	  fclose(chardev);
-	  fclose(fp);
-	  snd_pcm_close(handle);
-	  return -1;
+    sample_count = total_frames - start;
   }
 
-  // play entire file
-  int sample_count = hdr.subchunk_2_size/hdr.block_align;
+  // the loop point of a stream of unknown length is its end, not known up front
+  if (total_frames == UINT64_MAX && !duration_arg && loops != 1)
+  {
+    printf("Stream length unknown, playing it once\n");
+    loops = 1;
+  }
 
-  ret = play_wave_samples(fp, chardev, hdr, sample_count,  0);
-  if(ret)
+  // build DSP chain, stays empty (bypassed) without a config
+  dsp_chain_init(&chain, sample_rate);
+  if (dsp_config)
   {
-    printf("Error playing wave file %s\n", argv[1]);
-    printf("Tried to play %d samples\n", sample_count);
-    printf("Return code %d\n", ret);
-    fclose(chardev);
+    ret = dsp_chain_load(&chain, dsp_config);
+    if (ret)
+    {
+      printf("Could not load DSP config %s\n", dsp_config);
+      flac_close(&dec);
+      audio_group_close(&group);
+      fclose(fp);
+      snd_pcm_close(handle);
+      return ret;
+    }
+    printf("DSP chain: %u stage(s)\n", chain.count);
+  }
+
+  // every zone runs its own copy of the chain state
+  for (z = 0; z < group.count; z++)
+  {
+    group.zones[z].chain = chain;
+  }
+
+  // without DSP the file data can go straight to the drivers
+  if (!is_flac && !userspace_expand && !chain.count && driver_format(hdr) >= 0)
+  {
+    group.raw = !audio_group_set_format(&group, driver_format(hdr),
+                                        hdr.num_channels);
+  }
+  printf("Samples expanded by the %s\n", group.raw ? "driver" : "player");
+
+  // underruns are left to the hardware unless a policy was asked for
+  if (xrun_policy >= 0)
+  {
+    ret = audio_group_set_xrun(&group, xrun_policy, sample_rate);
+    if (ret)
+    {
+      printf("Could not set xrun policy %d\n", -ret);
+      flac_close(&dec);
+      audio_group_close(&group);
+      fclose(fp);
+      snd_pcm_close(handle);
+      return ret;
+    }
+  }
+
+  err = configure_codec(sample_rate, sound_format, handle, hwparams);
+  if (err < 0)
+  {
+    printf("PANIC 7\n");
+    flac_close(&dec);
+    audio_group_close(&group);
     fclose(fp);
     snd_pcm_close(handle);
-    i2s_disable_tx();
-    return ret;
+    return -1;
   }
-/*
-  // play last one second of file
-  ret = play_wave_samples(fp, hdr, hdr.sample_rate, hdr.sample_rate);
+
+  // Ctrl-C ends playback like the end of the file: TX drains and is
+  // disabled, no SA_RESTART so a blocked write returns at once
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = handle_sigint;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGINT, &sa, NULL);
+
+  printf("Playing frames %llu-%llu", (unsigned long long)start,
+         (unsigned long long)(start + sample_count));
+  if (!loops)
+    printf(", looping forever");
+  else if (loops > 1)
+    printf(", %u times", loops);
+  printf("\n");
+
+  // play the region, the whole file by default
+  if (is_flac)
+    ret = play_flac_samples(&dec, &group, sample_count, start, loops, &played);
+  else
+    ret = play_wave_samples(fp, &group, hdr, sample_count, start, loops,
+                            &played);
   if(ret)
   {
-    printf("Error playing wave file %s\n", argv[1]);
-    (void)munmap(pFIFO, 0x1000);
-    close(fd);
+    printf("Error playing file %s\n", wav_path);
+    printf("Tried to play %llu samples\n", (unsigned long long)sample_count);
+    printf("Return code %d\n", ret);
+    flac_close(&dec);
+    audio_group_close(&group);
     fclose(fp);
     snd_pcm_close(handle);
-    i2s_disable_tx();
     return ret;
   }
-*/
+
+  if (group.count > 1 && group.started)
+  {
+    printf("Zone start skew:\n");
+    audio_group_skew(&group, sample_rate);
+  }
+
+  // let the FIFOs play out before TX is disabled
+  audio_group_drain(&group);
+
+  // what was really played, Ctrl-C and -L 0 end at any block
+  report_stream_cost(&group, played, sample_rate);
+
+  if (is_flac)
+  {
+    flac_report(&dec);
+  }
+
+  if (xrun_policy >= 0)
+  {
+    printf("xruns: %u\n", group.xruns);
+  }
+
+  for (z = 0; z < group.count; z++)
+  {
+    dsp_chain_report(&group.zones[z].chain);
+  }
+
   // do rest of cleanup
-  fclose(chardev);
+  flac_close(&dec);
+  audio_group_close(&group);
   fclose(fp);
   snd_pcm_close(handle);
-  i2s_disable_tx();
+  trace_marker_close();
   return 0;
 }
@@ -0,0 +1,72 @@
+
+#include "trace_marker.h"
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define TRACE_MARKER_MAX 128
+
+// tracefs location first, older kernels only have it under debugfs
+static const char* marker_paths[] = {
+  "/sys/kernel/tracing/trace_marker",
+  "/sys/kernel/debug/tracing/trace_marker",
+};
+
+static int marker_fd = -1;
+
+int trace_marker_open(void)
+{
+  unsigned int i;
+
+  for (i = 0; i < sizeof(marker_paths) / sizeof(marker_paths[0]); i++)
+    {
+      marker_fd = open(marker_paths[i], O_WRONLY);
+      if (marker_fd >= 0)
+        {
+          return 0;
+        }
+    }
+
+  return -errno;
+}
+
+void trace_marker(const char* fmt, ...)
+{
+  char buf[TRACE_MARKER_MAX];
+  va_list args;
+  ssize_t ret;
+  int len;
+
+  if (marker_fd < 0)
+    {
+      return;
+    }
+
+  len = snprintf(buf, sizeof(buf), TRACE_MARKER_PREFIX);
+  va_start(args, fmt);
+  len += vsnprintf(buf + len, sizeof(buf) - len, fmt, args);
+  va_end(args);
+
+  if (len >= (int)sizeof(buf))
+    {
+      len = sizeof(buf) - 1;
+    }
+
+  // one write per marker, the kernel timestamps it on entry. A lost
+  // marker is not worth disturbing playback for.
+  ret = write(marker_fd, buf, len);
+  (void)ret;
+}
+
+void trace_marker_close(void)
+{
+  if (marker_fd >= 0)
+    {
+      close(marker_fd);
+      marker_fd = -1;
+    }
+}
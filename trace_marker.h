@@ -0,0 +1,19 @@
+#ifndef TRACE_MARKER_H
+#define TRACE_MARKER_H
+
+// prefix of every marker, tracetl keys on it
+#define TRACE_MARKER_PREFIX "sndsample: "
+
+/* @brief Open the ftrace marker file, markers are dropped until this
+   succeeds
+   @return 0 on success, < 0 on error */
+int trace_marker_open(void);
+
+/* @brief Write a marker into the kernel trace buffer
+   @param fmt printf style format, TRACE_MARKER_PREFIX is prepended */
+void trace_marker(const char* fmt, ...)
+  __attribute__((format(printf, 1, 2)));
+
+void trace_marker_close(void);
+
+#endif
@@ -0,0 +1,289 @@
+/* Merge player markers and kaudio tracepoints into a per-period timeline.
+   Reads ftrace text (/sys/kernel/tracing/trace) or trace-cmd report
+   output and prints one row per player block:
+
+     echo 1 > /sys/kernel/tracing/events/kaudio/enable
+     ./sndsample_u -t file.wav
+     cat /sys/kernel/tracing/trace | ./tracetl
+
+   or
+     trace-cmd record -e kaudio ./sndsample_u -t file.wav
+     trace-cmd report | ./tracetl */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "trace_marker.h"
+
+#define LINE_MAX_LEN 1024
+
+// everything seen between two "block N begin" markers
+struct period
+{
+  unsigned long long block;
+  double begin;     // block begin marker
+  double user_end;  // block end marker
+  unsigned int writes;
+  unsigned long long bytes;
+  double write_time;
+  unsigned int sleeps;
+  double sleep_time;
+  unsigned int irqs;
+  long long min_vacancy;
+  unsigned int overruns;
+  unsigned int xruns;
+};
+
+// open enter/sleep timestamps, events nest inside one write
+struct state
+{
+  struct period cur;
+  int active;
+  double first;
+  double write_enter;
+  double sleep_start;
+  long long minor; // only this minor, < 0 for all
+};
+
+void pr_usage(char* pname)
+{
+  printf("usage: %s [-m MINOR] [TRACE_FILE]\n", pname);
+}
+
+/* @brief Split a trace line into timestamp, event name and payload
+   @return 0 on success, < 0 if the line carries no event */
+static int parse_line(char* line, double* ts, char** event, char** payload)
+{
+  char *p, *tok, *end;
+
+  // task-pid [cpu] comes first, flags may follow
+  p = strchr(line, ']');
+  if (!p)
+    return -1;
+  p++;
+
+  // timestamp is the first numeric token ending in ':'
+  for (;;)
+    {
+      while (*p == ' ')
+        p++;
+      if (!*p)
+        return -1;
+
+      tok = p;
+      while (*p && *p != ' ')
+        p++;
+
+      if (p - tok > 1 && p[-1] == ':')
+        {
+          *ts = strtod(tok, &end);
+          if (end == p - 1)
+            break;
+        }
+    }
+
+  while (*p == ' ')
+    p++;
+
+  *event = p;
+  p = strchr(p, ':');
+  if (!p)
+    return -1;
+  *p++ = '\0';
+  *payload = p;
+
+  return 0;
+}
+
+static long long field(const char* payload, const char* name)
+{
+  const char* p = strstr(payload, name);
+
+  if (!p)
+    return -1;
+
+  return strtoll(p + strlen(name), NULL, 0);
+}
+
+static void print_header(void)
+{
+  printf("%8s %10s %8s %8s %6s %8s %8s %6s %8s %5s %7s %4s %4s\n",
+         "block", "time_s", "period", "user", "writes", "bytes",
+         "write", "sleeps", "sleep", "irqs", "min_vac", "ovr", "xrun");
+  printf("%8s %10s %8s %8s %6s %8s %8s %6s %8s %5s %7s %4s %4s\n",
+         "", "", "ms", "ms", "", "", "ms", "", "ms", "", "words", "", "");
+}
+
+static void print_period(const struct state* st, double end)
+{
+  const struct period* p = &st->cur;
+  double user = p->user_end > p->begin ? p->user_end - p->begin : 0.0;
+
+  // time in the block not spent inside write() belongs to the player
+  user -= p->write_time;
+  if (user < 0.0)
+    user = 0.0;
+
+  printf("%8llu %10.6f %8.3f %8.3f %6u %8llu %8.3f %6u %8.3f %5u %7lld %4u %4u\n",
+         p->block, p->begin - st->first, (end - p->begin) * 1e3, user * 1e3,
+         p->writes, p->bytes, p->write_time * 1e3, p->sleeps,
+         p->sleep_time * 1e3, p->irqs, p->min_vacancy, p->overruns,
+         p->xruns);
+}
+
+static void handle_marker(struct state* st, double ts, const char* text)
+{
+  unsigned long long block;
+  char what[16];
+
+  if (sscanf(text, "block %llu %15s", &block, what) == 2)
+    {
+      if (!strcmp(what, "begin"))
+        {
+          if (st->active)
+            {
+              print_period(st, ts);
+            }
+          else
+            {
+              st->first = ts;
+              print_header();
+            }
+
+          memset(&st->cur, 0, sizeof(st->cur));
+          st->cur.block = block;
+          st->cur.begin = ts;
+          st->cur.min_vacancy = -1;
+          st->active = 1;
+        }
+      else if (!strcmp(what, "end") && st->active)
+        {
+          st->cur.user_end = ts;
+        }
+      return;
+    }
+
+  // any other marker is shown inline
+  printf("%8s %10.6f  %s", "--", st->active ? ts - st->first : 0.0, text);
+}
+
+static void handle_event(struct state* st, double ts, const char* event,
+                         const char* payload)
+{
+  struct period* p = &st->cur;
+  long long vacancy;
+
+  if (!st->active || strncmp(event, "kaudio_", 7))
+    return;
+
+  if (st->minor >= 0 && field(payload, "minor=") != st->minor)
+    return;
+
+  if (!strcmp(event, "kaudio_write_enter"))
+    {
+      st->write_enter = ts;
+      p->writes++;
+      p->bytes += field(payload, "len=");
+    }
+  else if (!strcmp(event, "kaudio_write_exit"))
+    {
+      if (st->write_enter > 0.0)
+        p->write_time += ts - st->write_enter;
+      st->write_enter = 0.0;
+    }
+  else if (!strcmp(event, "kaudio_wait_sleep"))
+    {
+      st->sleep_start = ts;
+      p->sleeps++;
+    }
+  else if (!strcmp(event, "kaudio_wait_wake"))
+    {
+      if (st->sleep_start > 0.0)
+        p->sleep_time += ts - st->sleep_start;
+      st->sleep_start = 0.0;
+    }
+  else if (!strcmp(event, "kaudio_irq"))
+    {
+      p->irqs++;
+    }
+  else if (!strcmp(event, "kaudio_tx_overrun_reset"))
+    {
+      p->overruns++;
+    }
+  else if (!strcmp(event, "kaudio_xrun"))
+    {
+      p->xruns++;
+    }
+
+  vacancy = field(payload, "vacancy=");
+  if (vacancy >= 0 && (p->min_vacancy < 0 || vacancy < p->min_vacancy))
+    p->min_vacancy = vacancy;
+}
+
+int main(int argc, char** argv)
+{
+  struct state st;
+  char line[LINE_MAX_LEN];
+  char *event, *payload, *marker;
+  double ts, last = 0.0;
+  FILE* fp = stdin;
+  int opt;
+
+  memset(&st, 0, sizeof(st));
+  st.minor = -1;
+
+  while ((opt = getopt(argc, argv, "m:")) != -1)
+    {
+      switch (opt)
+        {
+        case 'm':
+          st.minor = strtoll(optarg, NULL, 0);
+          break;
+        default:
+          pr_usage(argv[0]);
+          return 1;
+        }
+    }
+
+  if (optind < argc)
+    {
+      fp = fopen(argv[optind], "r");
+      if (!fp)
+        {
+          printf("Could not open %s\n", argv[optind]);
+          return 1;
+        }
+    }
+
+  while (fgets(line, sizeof(line), fp))
+    {
+      // comment lines of the ftrace header
+      if (line[0] == '#')
+        continue;
+
+      marker = strstr(line, TRACE_MARKER_PREFIX);
+
+      if (parse_line(line, &ts, &event, &payload))
+        continue;
+      last = ts;
+
+      if (marker)
+        handle_marker(&st, ts, marker + strlen(TRACE_MARKER_PREFIX));
+      else
+        handle_event(&st, ts, event, payload);
+    }
+
+  if (st.active)
+    print_period(&st, last);
+  else
+    printf("No %sblock markers found, was the player run with -t?\n",
+           TRACE_MARKER_PREFIX);
+
+  if (fp != stdin)
+    fclose(fp);
+
+  return 0;
+}